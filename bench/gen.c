@@ -0,0 +1,528 @@
+/*
+ * 2008+ Copyright (c) Evgeniy Polyakov <zbr@ioremap.net>
+ * 2011+ Copyright (c) Anton Kortunov <toshic.toshic@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Synthetic input generator for converter benchmarks: old meta and history
+ * Kyoto Cabinet databases plus eblob or filesystem data tree sharing the
+ * same key set. Output is fully determined by seed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <kclangc.h>
+
+#include <elliptics/packet.h>
+#include <elliptics/interface.h>
+#include <eblob/blob.h>
+
+#include "common.h"
+
+struct gen_range {
+	unsigned long long	min;
+	unsigned long long	max;
+};
+
+struct gen_ctl {
+	char			*meta_name;
+	char			*history_name;
+	char			*eblob_name;
+	char			*fs_name;
+
+	unsigned long long	records;
+	unsigned long long	seed;
+
+	struct gen_range	size;
+	struct gen_range	name;
+	struct gen_range	groups;
+	struct gen_range	history;
+	int			history_overlap;
+
+	unsigned long long	meta_bytes;
+	unsigned long long	history_bytes;
+	unsigned long long	data_bytes;
+};
+
+static void gen_usage(const char *p)
+{
+	fprintf(stderr, "Usage: %s args\n", p);
+	fprintf(stderr, " -M, --meta PATH             - old meta database to create\n"
+			" -H, --history PATH          - history database to create\n"
+			" -E, --eblob PATH            - eblob data file to create\n"
+			" -F, --fs PATH               - filesystem data tree root to create\n"
+			" -n, --records N             - number of objects (default 100000)\n"
+			" -s, --seed N                - random seed (default 1)\n"
+			" -z, --size MIN:MAX          - object size, log-uniform (default 1024:1048576)\n"
+			" -o, --name MIN:MAX          - parent object name length (default 0:64)\n"
+			" -g, --groups MIN:MAX        - number of groups in meta (default 1:3)\n"
+			" -e, --history-entries MIN:MAX - history entries per object (default 1:8)\n"
+			" -p, --history-overlap PCT   - share of history keys present in meta (default 90)\n"
+			" -h, --help                  - this help\n");
+	exit(-1);
+}
+
+static unsigned long long gen_state;
+
+/* xorshift64* */
+static unsigned long long gen_rand(void)
+{
+	gen_state ^= gen_state >> 12;
+	gen_state ^= gen_state << 25;
+	gen_state ^= gen_state >> 27;
+	return gen_state * 2685821657736338717ULL;
+}
+
+static unsigned long long gen_uniform(struct gen_range *r)
+{
+	if (r->max <= r->min)
+		return r->min;
+
+	return r->min + gen_rand() % (r->max - r->min + 1);
+}
+
+/* object sizes span several orders of magnitude, so pick exponent uniformly */
+static unsigned long long gen_log_uniform(struct gen_range *r)
+{
+	double lo, hi, x;
+
+	if (r->max <= r->min || !r->min)
+		return gen_uniform(r);
+
+	lo = log((double)r->min);
+	hi = log((double)r->max);
+	x = lo + (hi - lo) * ((double)(gen_rand() >> 11) / (double)(1ULL << 53));
+
+	return (unsigned long long)exp(x);
+}
+
+static int gen_parse_range(const char *value, struct gen_range *r)
+{
+	char *end;
+
+	r->min = strtoull(value, &end, 0);
+	r->max = r->min;
+
+	if (*end == ':')
+		r->max = strtoull(end + 1, &end, 0);
+
+	if (*end || r->max < r->min)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* keys only depend on seed and index, so every output shares the same set */
+static void gen_key(struct gen_ctl *ctl, unsigned long long idx, struct dnet_raw_id *id)
+{
+	unsigned long long r;
+	unsigned int i;
+
+	gen_state = (ctl->seed + 1) * 0x9E3779B97F4A7C15ULL + idx * 0xBF58476D1CE4E5B9ULL;
+	if (!gen_state)
+		gen_state = 1;
+
+	for (i = 0; i < DNET_ID_SIZE; i += sizeof(r)) {
+		r = gen_rand();
+		memcpy(id->id + i, &r, sizeof(r));
+	}
+}
+
+static int gen_meta(struct gen_ctl *ctl)
+{
+	struct dnet_meta_create_control mctl;
+	struct dnet_meta_arena arena;
+	struct dnet_raw_id id;
+	char name[256];
+	int group_ids[64];
+	unsigned long long i;
+	unsigned int j;
+	KCDB *db;
+	int err, size;
+
+	memset(&arena, 0, sizeof(arena));
+
+	db = kcdbnew();
+	err = kcdbopen(db, ctl->meta_name, KCOWRITER | KCOCREATE | KCOTRUNCATE);
+	if (!err) {
+		fprintf(stderr, "Failed to create meta database '%s': %d.\n", ctl->meta_name, -kcdbecode(db));
+		err = -EIO;
+		goto err_out_del;
+	}
+
+	for (i = 0; i < ctl->records; ++i) {
+		gen_key(ctl, i, &id);
+
+		memset(&mctl, 0, sizeof(mctl));
+		dnet_setup_id(&mctl.id, 0, id.id);
+
+		mctl.len = gen_uniform(&ctl->name);
+		if (mctl.len > (int)sizeof(name))
+			mctl.len = sizeof(name);
+		for (j = 0; j < (unsigned int)mctl.len; ++j)
+			name[j] = 'a' + gen_rand() % 26;
+		mctl.obj = name;
+
+		mctl.group_num = gen_uniform(&ctl->groups);
+		if (mctl.group_num > (int)ARRAY_SIZE(group_ids))
+			mctl.group_num = ARRAY_SIZE(group_ids);
+		for (j = 0; j < (unsigned int)mctl.group_num; ++j)
+			group_ids[j] = j + 1;
+		mctl.groups = group_ids;
+
+		mctl.ts.tv_sec = 1300000000 + gen_rand() % 100000000;
+		for (j = 0; j < DNET_CSUM_SIZE; ++j)
+			mctl.checksum[j] = gen_rand();
+
+		if (!dnet_meta_arena_reserve(&arena, dnet_create_meta_size(&mctl))) {
+			err = -ENOMEM;
+			goto err_out_close;
+		}
+
+		size = dnet_create_write_meta_buf(&mctl, arena.data, arena.size);
+		if (size <= 0) {
+			err = size;
+			goto err_out_close;
+		}
+
+		if (!kcdbset(db, (char *)id.id, DNET_ID_SIZE, arena.data, size)) {
+			fprintf(stderr, "Failed to store meta record: %d.\n", -kcdbecode(db));
+			err = -EIO;
+			goto err_out_close;
+		}
+
+		ctl->meta_bytes += DNET_ID_SIZE + size;
+	}
+
+	err = 0;
+
+err_out_close:
+	kcdbclose(db);
+err_out_del:
+	kcdbdel(db);
+	dnet_meta_arena_destroy(&arena);
+	return err;
+}
+
+/*
+ * History covers the same objects, part of its keys are shifted out of
+ * meta key set to exercise metadata re-creation path.
+ */
+static int gen_history(struct gen_ctl *ctl)
+{
+	struct dnet_history_entry *ent = NULL;
+	struct dnet_raw_id id;
+	unsigned long long i, idx, num, max = ctl->history.max ? ctl->history.max : 1;
+	unsigned long long j;
+	KCDB *db;
+	int err;
+
+	ent = malloc(max * sizeof(struct dnet_history_entry));
+	if (!ent)
+		return -ENOMEM;
+
+	db = kcdbnew();
+	err = kcdbopen(db, ctl->history_name, KCOWRITER | KCOCREATE | KCOTRUNCATE);
+	if (!err) {
+		fprintf(stderr, "Failed to create history database '%s': %d.\n", ctl->history_name, -kcdbecode(db));
+		err = -EIO;
+		goto err_out_del;
+	}
+
+	for (i = 0; i < ctl->records; ++i) {
+		idx = i;
+		if ((i * 100 / (ctl->records ? ctl->records : 1)) >= (unsigned long long)ctl->history_overlap)
+			idx += ctl->records;
+
+		gen_key(ctl, idx, &id);
+
+		num = gen_uniform(&ctl->history);
+		if (!num)
+			num = 1;
+		if (num > max)
+			num = max;
+
+		memset(ent, 0, num * sizeof(struct dnet_history_entry));
+		for (j = 0; j < num; ++j) {
+			memcpy(ent[j].id, id.id, DNET_ID_SIZE);
+			ent[j].tsec = 1300000000 + j * 3600 + gen_rand() % 3600;
+			ent[j].tnsec = gen_rand() % 1000000000;
+			ent[j].size = gen_log_uniform(&ctl->size);
+			if (j == num - 1 && !(gen_rand() % 50))
+				ent[j].flags = DNET_IO_FLAGS_REMOVED;
+			dnet_convert_history_entry(&ent[j]);
+		}
+
+		if (!kcdbset(db, (char *)id.id, DNET_ID_SIZE, (char *)ent, num * sizeof(struct dnet_history_entry))) {
+			fprintf(stderr, "Failed to store history record: %d.\n", -kcdbecode(db));
+			err = -EIO;
+			goto err_out_close;
+		}
+
+		ctl->history_bytes += DNET_ID_SIZE + num * sizeof(struct dnet_history_entry);
+	}
+
+	err = 0;
+
+err_out_close:
+	kcdbclose(db);
+err_out_del:
+	kcdbdel(db);
+	free(ent);
+	return err;
+}
+
+static char *gen_data_buf(struct gen_ctl *ctl)
+{
+	unsigned long long i, *p;
+	char *buf;
+
+	buf = malloc(ctl->size.max + sizeof(unsigned long long));
+	if (!buf)
+		return NULL;
+
+	gen_state = ctl->seed + 1;
+	p = (unsigned long long *)buf;
+	for (i = 0; i < ctl->size.max / sizeof(unsigned long long) + 1; ++i)
+		p[i] = gen_rand();
+
+	return buf;
+}
+
+static int gen_eblob(struct gen_ctl *ctl)
+{
+	struct dnet_bulk_blob bb;
+	struct dnet_raw_id id;
+	unsigned long long i, size;
+	char *buf;
+	int err;
+
+	buf = gen_data_buf(ctl);
+	if (!buf)
+		return -ENOMEM;
+
+	err = dnet_bulk_blob_init(&bb, ctl->eblob_name);
+	if (err)
+		goto err_out_free;
+
+	for (i = 0; i < ctl->records; ++i) {
+		gen_key(ctl, i, &id);
+		size = gen_log_uniform(&ctl->size);
+
+		err = dnet_bulk_blob_write(&bb, &id, buf, size);
+		if (err) {
+			fprintf(stderr, "Failed to write eblob record: %d.\n", err);
+			break;
+		}
+
+		ctl->data_bytes += size;
+	}
+
+	if (dnet_bulk_blob_cleanup(&bb) && !err)
+		err = -EIO;
+
+err_out_free:
+	free(buf);
+	return err;
+}
+
+/* elliptics filesystem backend layout: root/<first id byte>/<full hex id> */
+static int gen_fs(struct gen_ctl *ctl)
+{
+	char id_str[2 * DNET_ID_SIZE + 1];
+	char path[PATH_MAX];
+	struct dnet_raw_id id;
+	unsigned long long i, size;
+	char *buf;
+	int fd, err = 0;
+
+	buf = gen_data_buf(ctl);
+	if (!buf)
+		return -ENOMEM;
+
+	if (mkdir(ctl->fs_name, 0755) && errno != EEXIST) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to create directory: %d.\n", ctl->fs_name, err);
+		goto err_out_free;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		snprintf(path, sizeof(path), "%s/%02llx", ctl->fs_name, i);
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			err = -errno;
+			fprintf(stderr, "%s: failed to create directory: %d.\n", path, err);
+			goto err_out_free;
+		}
+	}
+
+	for (i = 0; i < ctl->records; ++i) {
+		gen_key(ctl, i, &id);
+		size = gen_log_uniform(&ctl->size);
+
+		dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str);
+		snprintf(path, sizeof(path), "%s/%02x/%s", ctl->fs_name, id.id[0], id_str);
+
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			err = -errno;
+			fprintf(stderr, "%s: failed to create: %d.\n", path, err);
+			goto err_out_free;
+		}
+
+		if (write(fd, buf, size) != (ssize_t)size) {
+			err = -EIO;
+			fprintf(stderr, "%s: failed to write %llu bytes.\n", path, size);
+			close(fd);
+			goto err_out_free;
+		}
+
+		close(fd);
+		ctl->data_bytes += size;
+	}
+
+err_out_free:
+	free(buf);
+	return err;
+}
+
+static struct option gen_options[] = {
+	{"meta",		required_argument,	NULL,	'M'},
+	{"history",		required_argument,	NULL,	'H'},
+	{"eblob",		required_argument,	NULL,	'E'},
+	{"fs",			required_argument,	NULL,	'F'},
+	{"records",		required_argument,	NULL,	'n'},
+	{"seed",		required_argument,	NULL,	's'},
+	{"size",		required_argument,	NULL,	'z'},
+	{"name",		required_argument,	NULL,	'o'},
+	{"groups",		required_argument,	NULL,	'g'},
+	{"history-entries",	required_argument,	NULL,	'e'},
+	{"history-overlap",	required_argument,	NULL,	'p'},
+	{"help",		no_argument,		NULL,	'h'},
+	{NULL,			0,			NULL,	0},
+};
+
+int main(int argc, char *argv[])
+{
+	struct gen_ctl ctl;
+	struct gen_range *r;
+	int err, ch;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.records = 100000;
+	ctl.seed = 1;
+	ctl.size.min = 1024;
+	ctl.size.max = 1024 * 1024;
+	ctl.name.max = 64;
+	ctl.groups.min = 1;
+	ctl.groups.max = 3;
+	ctl.history.min = 1;
+	ctl.history.max = 8;
+	ctl.history_overlap = 90;
+
+	while ((ch = getopt_long(argc, argv, "M:H:E:F:n:s:z:o:g:e:p:h", gen_options, NULL)) != -1) {
+		r = NULL;
+
+		switch (ch) {
+			case 'M':
+				ctl.meta_name = optarg;
+				break;
+			case 'H':
+				ctl.history_name = optarg;
+				break;
+			case 'E':
+				ctl.eblob_name = optarg;
+				break;
+			case 'F':
+				ctl.fs_name = optarg;
+				break;
+			case 'n':
+				ctl.records = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				ctl.seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'z':
+				r = &ctl.size;
+				break;
+			case 'o':
+				r = &ctl.name;
+				break;
+			case 'g':
+				r = &ctl.groups;
+				break;
+			case 'e':
+				r = &ctl.history;
+				break;
+			case 'p':
+				ctl.history_overlap = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				gen_usage(argv[0]);
+		}
+
+		if (r && gen_parse_range(optarg, r)) {
+			fprintf(stderr, "Invalid range '%s', expected MIN:MAX.\n", optarg);
+			gen_usage(argv[0]);
+		}
+	}
+
+	if (!ctl.meta_name && !ctl.history_name && !ctl.eblob_name && !ctl.fs_name) {
+		fprintf(stderr, "You have to provide at least one output.\n");
+		gen_usage(argv[0]);
+	}
+
+	if (ctl.meta_name) {
+		err = gen_meta(&ctl);
+		if (err)
+			goto err_out_exit;
+	}
+
+	if (ctl.history_name) {
+		err = gen_history(&ctl);
+		if (err)
+			goto err_out_exit;
+	}
+
+	if (ctl.eblob_name) {
+		err = gen_eblob(&ctl);
+		if (err)
+			goto err_out_exit;
+	}
+
+	if (ctl.fs_name) {
+		err = gen_fs(&ctl);
+		if (err)
+			goto err_out_exit;
+	}
+
+	printf("records: %llu, meta bytes: %llu, history bytes: %llu, data bytes: %llu\n",
+			ctl.records, ctl.meta_bytes, ctl.history_bytes, ctl.data_bytes);
+	return 0;
+
+err_out_exit:
+	fprintf(stderr, "Generation failed: %d.\n", err);
+	return err;
+}
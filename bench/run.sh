@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# Generates synthetic dataset and runs every converter over it, reporting
+# wall time, records/s, input bytes/s and peak RSS for each run, followed by
+# per-phase latency totals and quantiles from the converter's stats file.
+#
+# Usage: bench/run.sh [workdir] [records]
+# Environment:
+#   BIN      - directory with built converters (default: current directory)
+#   THREADS  - worker threads for converters (default: 8)
+#   GEN_ARGS - extra dnet_bench_gen options, e.g. "--size 4096:65536 --groups 2:2"
+#
+
+set -e
+
+BIN=${BIN:-.}
+DIR=${1:-bench-data}
+RECORDS=${2:-100000}
+THREADS=${THREADS:-8}
+GEN_ARGS=${GEN_ARGS:-}
+TIME=/usr/bin/time
+
+if [ ! -x "$TIME" ]; then
+	echo "GNU time is required at $TIME" >&2
+	exit 1
+fi
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+
+bytes() {
+	du -sk "$@" | awk '{ s += $1 } END { print s * 1024 }'
+}
+
+# phases STATS_FILE - prints non-empty phases of a converter stats dump
+phases() {
+	[ -f "$1" ] || return 0
+
+	awk 'function field(s, k,   t) {
+		t = s
+		if (!sub(".*\"" k "\": ", "", t))
+			return 0
+		sub(/[,}].*/, "", t)
+		return t
+	}
+	/"count":/ {
+		name = $0
+		sub(/^ *"/, "", name)
+		sub(/".*/, "", name)
+		count = field($0, "count") + 0
+		if (!count)
+			next
+		printf "  %-18s %12d calls %9.2f s total %9.1f us p50 %9.1f us p99\n", name, count,
+			field($0, "total_ns") / 1e9, field($0, "p50_ns") / 1e3, field($0, "p99_ns") / 1e3
+	}' "$1"
+}
+
+# measure NAME RECORDS BYTES command...
+# "$DIR/NAME.stats.json", if the command wrote one, is summarised after timings.
+measure() {
+	name=$1
+	records=$2
+	input=$3
+	shift 3
+
+	if ! $TIME -f "%e %M" -o "$DIR/$name.time" "$@" > "$DIR/$name.log" 2>&1; then
+		echo "$name failed, see $DIR/$name.log" >&2
+		exit 1
+	fi
+
+	read wall rss < "$DIR/$name.time"
+	awk -v n="$name" -v w="$wall" -v r="$records" -v b="$input" -v rss="$rss" 'BEGIN {
+		if (w < 0.01)
+			w = 0.01;
+		printf "%-20s %9.2f s %12.0f rec/s %9.2f MB/s %9d KB peak RSS\n", n, w, r / w, b / w / 1048576, rss
+	}'
+
+	phases "$DIR/$name.stats.json"
+}
+
+echo "records: $RECORDS, threads: $THREADS, workdir: $DIR"
+
+measure generate "$RECORDS" 0 "$BIN/dnet_bench_gen" -n "$RECORDS" $GEN_ARGS \
+	-M "$DIR/meta.kch" -H "$DIR/history.kch" -E "$DIR/data" -F "$DIR/fs"
+
+measure meta "$RECORDS" "$(bytes "$DIR/meta.kch")" \
+	"$BIN/dnet_convert_meta" -M "$DIR/meta.kch" -N "$DIR/newmeta" -g 1:2 -j "$THREADS" -v 1 \
+	-t "$DIR/meta.stats.json"
+
+measure meta-bulk "$RECORDS" "$(bytes "$DIR/meta.kch")" \
+	"$BIN/dnet_convert_meta" -M "$DIR/meta.kch" -N "$DIR/bulkmeta" -g 1:2 -j "$THREADS" -B -v 1 \
+	-t "$DIR/meta-bulk.stats.json"
+
+measure history "$RECORDS" "$(bytes "$DIR/history.kch")" \
+	"$BIN/dnet_convert_history" -H "$DIR/history.kch" -M "$DIR/newmeta" -g 1:2 -v 1 \
+	-t "$DIR/history.stats.json"
+
+measure files-eblob "$RECORDS" "$(bytes "$DIR"/data.*.index)" \
+	"$BIN/dnet_convert_files" --input-path "$DIR/data" --meta "$DIR/newmeta" \
+	--threads "$THREADS" --verbose 1 --stats "$DIR/files-eblob.stats.json"
+
+measure files-eblob-csum "$RECORDS" "$(bytes "$DIR"/data.*)" \
+	"$BIN/dnet_convert_files" --input-path "$DIR/data" --meta "$DIR/newmeta" \
+	--threads "$THREADS" --enable-checksum 1 --verbose 1 --stats "$DIR/files-eblob-csum.stats.json"
+
+measure files-fs-csum "$RECORDS" "$(bytes "$DIR/fs")" \
+	"$BIN/dnet_convert_files" --input-path "$DIR/fs" --meta "$DIR/newmeta" \
+	--threads "$THREADS" --enable-checksum 1 --verbose 1 --stats "$DIR/files-fs-csum.stats.json"
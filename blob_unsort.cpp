@@ -1,16 +1,20 @@
-
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <fstream>
+#include <queue>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/program_options.hpp>
@@ -24,58 +28,411 @@ namespace fs = boost::filesystem;
 
 #include "common.h"
 
+/* index entry is only referenced by its number, so sorting moves 16 bytes */
+struct index_entry {
+	uint64_t position;
+	uint64_t num;
+};
+
+static const size_t radix_bits = 8;
+static const size_t radix_size = 1 << radix_bits;
+static const size_t parallel_threshold = 1024 * 1024;
+static const size_t write_buffer_size = 4 * 1024 * 1024;
+static const size_t run_buffer_size = 64 * 1024;
+static const size_t merge_fan_in = 256;
+
+static size_t digit(const index_entry &e, int shift) {
+	return (e.position >> shift) & (radix_size - 1);
+}
+
+static void radix_count(const index_entry *src, size_t num, int shift, size_t *count) {
+	memset(count, 0, radix_size * sizeof(size_t));
+
+	for (size_t i = 0; i < num; ++i)
+		count[digit(src[i], shift)]++;
+}
+
+static void radix_scatter(const index_entry *src, size_t num, int shift, index_entry *dst, size_t *offset) {
+	for (size_t i = 0; i < num; ++i)
+		dst[offset[digit(src[i], shift)]++] = src[i];
+}
+
+/*
+ * Stable LSD radix sort by position, one byte per pass. Every thread owns
+ * a contiguous slice of the input and writes it to its own offsets in each
+ * bucket, so order of equal positions is preserved. Passes where all keys
+ * share the same byte are skipped.
+ */
+static void radix_sort(std::vector<index_entry> &entries, int thread_num) {
+	if (entries.empty())
+		return;
+
+	std::vector<index_entry> tmp(entries.size());
+	index_entry *src = &entries[0], *dst = &tmp[0];
+	size_t num = entries.size();
+
+	if (num < parallel_threshold)
+		thread_num = 1;
 
-boost::iostreams::mapped_file file_;
-std::map<uint64_t, struct eblob_disk_control *> blob_index;
+	size_t slice = (num + thread_num - 1) / thread_num;
+	std::vector<size_t> count(thread_num * radix_size);
 
-void open_index(std::string &path) {
-	std::ostringstream filename;
-	struct eblob_disk_control *dc;
-	uint64_t index_pos;
+	for (int shift = 0; shift < 64; shift += radix_bits) {
+		boost::thread_group threads;
 
+		for (int t = 0; t < thread_num; ++t) {
+			size_t start = std::min(num, t * slice);
+			threads.create_thread(boost::bind(radix_count, src + start, std::min(num, start + slice) - start,
+						shift, &count[t * radix_size]));
+		}
+		threads.join_all();
+
+		size_t pos = 0, max = 0;
+		for (size_t d = 0; d < radix_size; ++d) {
+			size_t bucket = 0;
+
+			for (int t = 0; t < thread_num; ++t) {
+				size_t c = count[t * radix_size + d];
 
-	file_.open(path, std::ios_base::in | std::ios_base::binary);
+				count[t * radix_size + d] = pos;
+				pos += c;
+				bucket += c;
+			}
 
-	index_pos = 0;
-	while (index_pos < file_.size()) {
+			max = std::max(max, bucket);
+		}
 
-		dc = (struct eblob_disk_control *)(file_.const_data() + index_pos);
+		if (max == num)
+			continue;
 
-		blob_index[dc->position] = dc;
+		for (int t = 0; t < thread_num; ++t) {
+			size_t start = std::min(num, t * slice);
+			threads.create_thread(boost::bind(radix_scatter, src + start, std::min(num, start + slice) - start,
+						shift, dst, &count[t * radix_size]));
+		}
+		threads.join_all();
 
-		index_pos += sizeof(struct eblob_disk_control);
+		std::swap(src, dst);
 	}
+
+	if (src != &entries[0])
+		entries.swap(tmp);
 }
 
-int main(int argc, char *argv[])
-{
-	std::map<uint64_t, struct eblob_disk_control *>::iterator iter;
-	struct eblob_disk_control *dc;
+/*
+ * Buffered writer of output index, also used for sorted runs.
+ */
+class index_writer {
+	public:
+		index_writer(const std::string &path) : path_(path), written_(0) {
+			out_.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out_)
+				throw std::runtime_error("Failed to open " + path);
+
+			buf_.reserve(write_buffer_size);
+		}
+
+		void append(const char *dc) {
+			buf_.insert(buf_.end(), dc, dc + sizeof(struct eblob_disk_control));
+			written_++;
+
+			if (buf_.size() + sizeof(struct eblob_disk_control) > write_buffer_size)
+				flush();
+		}
+
+		void close(void) {
+			flush();
+			out_.close();
+			if (out_.fail())
+				throw std::runtime_error("Failed to write " + path_);
+		}
+
+		uint64_t written(void) const {
+			return written_;
+		}
+
+	private:
+		std::string path_;
+		std::ofstream out_;
+		std::vector<char> buf_;
+		uint64_t written_;
+
+		void flush(void) {
+			if (!buf_.empty())
+				out_.write(&buf_[0], buf_.size());
+			buf_.clear();
+		}
+};
+
+/*
+ * Sorted run read back sequentially through its own buffer.
+ */
+class run_reader {
+	public:
+		run_reader(const std::string &path, int num, size_t buffer_size) : num(num), buf_(buffer_size) {
+			in_.rdbuf()->pubsetbuf(&buf_[0], buf_.size());
+			in_.open(path.c_str(), std::ios::in | std::ios::binary);
+			if (!in_)
+				throw std::runtime_error("Failed to open run " + path);
+		}
+
+		bool next(void) {
+			if (!in_.read(dc, sizeof(dc)))
+				return false;
+
+			memcpy(&position, dc + offsetof(struct eblob_disk_control, position), sizeof(position));
+			return true;
+		}
+
+		int num;
+		uint64_t position;
+		char dc[sizeof(struct eblob_disk_control)];
+
+	private:
+		std::vector<char> buf_;
+		std::ifstream in_;
+};
+
+/* heap of runs ordered by position, earlier run goes first on equal positions */
+struct run_greater {
+	bool operator()(const run_reader *r1, const run_reader *r2) const {
+		if (r1->position != r2->position)
+			return r1->position > r2->position;
+		return r1->num > r2->num;
+	}
+};
+
+/* @data holds @num records, writes them out in position order */
+static void write_sorted(const char *data, size_t num, index_writer &out, int thread_num, bool unique) {
+	std::vector<index_entry> entries(num);
+	struct eblob_disk_control dc;
+
+	for (size_t i = 0; i < num; ++i) {
+		memcpy(&dc, data + i * sizeof(struct eblob_disk_control), sizeof(dc));
+
+		entries[i].position = dc.position;
+		entries[i].num = i;
+	}
+
+	radix_sort(entries, thread_num);
+
+	/* only the last of entries with the same position is kept */
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (unique && i + 1 < entries.size() && entries[i + 1].position == entries[i].position)
+			continue;
+
+		out.append(data + entries[i].num * sizeof(struct eblob_disk_control));
+	}
+}
+
+static uint64_t sort_in_memory(const std::string &input, index_writer &out, int thread_num) {
+	boost::iostreams::mapped_file file(input, std::ios_base::in | std::ios_base::binary);
+
+	write_sorted(file.const_data(), file.size() / sizeof(struct eblob_disk_control), out, thread_num, true);
+	return file.size() / sizeof(struct eblob_disk_control);
+}
+
+/*
+ * Merges sorted @runs into @out with a heap, ties go to the earlier run.
+ * With @unique only the last record of every position is written.
+ */
+static void merge_runs(const std::vector<std::string> &runs, index_writer &out, size_t buffer_size, bool unique) {
+	std::priority_queue<run_reader *, std::vector<run_reader *>, run_greater> heap;
+	std::vector<run_reader *> readers;
+
+	try {
+		for (size_t i = 0; i < runs.size(); ++i) {
+			readers.push_back(new run_reader(runs[i], i, buffer_size));
+			if (readers.back()->next())
+				heap.push(readers.back());
+		}
+
+		/* record is held back until it is known to be the last one with its position */
+		char last[sizeof(struct eblob_disk_control)];
+		uint64_t last_position = 0;
+		bool have_last = false;
+
+		while (!heap.empty()) {
+			run_reader *r = heap.top();
+			heap.pop();
+
+			if (!unique)
+				out.append(r->dc);
+			else {
+				if (have_last && last_position != r->position)
+					out.append(last);
+
+				memcpy(last, r->dc, sizeof(last));
+				last_position = r->position;
+				have_last = true;
+			}
+
+			if (r->next())
+				heap.push(r);
+		}
+
+		if (have_last)
+			out.append(last);
+	} catch (...) {
+		for (size_t i = 0; i < readers.size(); ++i)
+			delete readers[i];
+		throw;
+	}
+
+	for (size_t i = 0; i < readers.size(); ++i)
+		delete readers[i];
+}
+
+/*
+ * Input is read sequentially in pieces that fit into @mem_limit together
+ * with sort arrays, every piece is sorted into a run in @temp_dir. Runs are
+ * merged at most @merge_fan_in at a time, so reader buffers stay within
+ * @mem_limit and open files are bounded; adjacent runs are merged together,
+ * so ties are still resolved in input order and the same record as in
+ * memory wins for duplicate positions.
+ */
+static uint64_t sort_external(const std::string &input, index_writer &out, uint64_t mem_limit,
+		const std::string &temp_dir, int thread_num) {
+	/* record itself and two 16-byte sort entries */
+	size_t per_run = std::max<uint64_t>(mem_limit / (sizeof(struct eblob_disk_control) + 2 * sizeof(index_entry)), 1);
+	/* reader buffers share what is left after output buffer, at least two runs are merged */
+	uint64_t merge_mem = mem_limit > write_buffer_size ? mem_limit - write_buffer_size : 0;
+	size_t fan_in = std::min<uint64_t>(std::max<uint64_t>(merge_mem / run_buffer_size, 2), merge_fan_in);
+	std::vector<std::string> runs, temps;
+	std::vector<char> data;
+	std::ifstream in;
+	uint64_t total = 0;
+	int pass = 0;
+
+	in.open(input.c_str(), std::ios::in | std::ios::binary);
+	if (!in)
+		throw std::runtime_error("Failed to open " + input);
+
+	data.resize(per_run * sizeof(struct eblob_disk_control));
 
 	try {
-		if (argc != 3) {
-			std::ostringstream error_text;
-			error_text << "Usage: " << argv[0] << " input_blob output_blob";
+		while (in) {
+			in.read(&data[0], data.size());
+
+			size_t num = in.gcount() / sizeof(struct eblob_disk_control);
+			if (!num)
+				break;
+
+			std::ostringstream name;
+			name << temp_dir << "/blob_unsort." << getpid() << "." << temps.size();
+			temps.push_back(name.str());
+			runs.push_back(name.str());
 
-			throw std::runtime_error(error_text.str());
+			index_writer run(runs.back());
+			write_sorted(&data[0], num, run, thread_num, false);
+			run.close();
+
+			total += num;
+		}
+
+		std::vector<char>().swap(data);
+
+		std::cout << "sorted " << total << " elements into " << runs.size() << " runs" << std::endl;
+
+		while (runs.size() > fan_in) {
+			std::vector<std::string> merged;
+
+			for (size_t i = 0; i < runs.size(); i += fan_in) {
+				std::vector<std::string> group(runs.begin() + i, runs.begin() + std::min(i + fan_in, runs.size()));
+
+				if (group.size() == 1) {
+					merged.push_back(group[0]);
+					continue;
+				}
+
+				std::ostringstream name;
+				name << temp_dir << "/blob_unsort." << getpid() << "." << temps.size();
+				temps.push_back(name.str());
+				merged.push_back(name.str());
+
+				index_writer run(merged.back());
+				merge_runs(group, run, std::max<uint64_t>(merge_mem / group.size(), run_buffer_size), false);
+				run.close();
+
+				for (size_t j = 0; j < group.size(); ++j)
+					unlink(group[j].c_str());
+			}
+
+			runs.swap(merged);
+			std::cout << "merge pass " << ++pass << ": " << runs.size() << " runs left" << std::endl;
 		}
 
-		std::string input_path(argv[1]);
+		merge_runs(runs, out, std::max<uint64_t>(merge_mem / std::max<size_t>(runs.size(), 1), run_buffer_size), true);
+	} catch (...) {
+		for (size_t i = 0; i < temps.size(); ++i)
+			unlink(temps[i].c_str());
+		throw;
+	}
+
+	for (size_t i = 0; i < temps.size(); ++i)
+		unlink(temps[i].c_str());
+
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		namespace po = boost::program_options;
+		po::options_description desc("Usage: blob_unsort [options] input_index output_index\nOptions");
+		po::positional_options_description pos;
+		std::string input, output, temp_dir;
+		uint64_t mem_limit;
+		int thread_num;
+		struct stat st;
 
-		std::ofstream unsorted_index(argv[2], std::ios::out | std::ios::binary);
+		desc.add_options()
+			("help", "This help message")
+			("input", po::value<std::string>(&input), "Index to sort by record position")
+			("output", po::value<std::string>(&output), "Resulting index")
+			("mem-limit", po::value<uint64_t>(&mem_limit)->default_value(0),
+				"Memory budget in megabytes, larger indexes are sorted externally (0 - unlimited)")
+			("temp-dir", po::value<std::string>(&temp_dir),
+				"Directory for sorted runs (default: directory of output index)")
+			("threads", po::value<int>(&thread_num)->default_value(boost::thread::hardware_concurrency()),
+				"Number of threads used to sort")
+		;
+		pos.add("input", 1).add("output", 1);
 
-		open_index(input_path);
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+		po::notify(vm);
 
-		std::cout << "loaded " << blob_index.size() << " elements" << std::endl;
+		if (vm.count("help") || input.empty() || output.empty()) {
+			std::cout << desc << "\n";
+			return -1;
+		}
 
-		for (iter = blob_index.begin(); iter != blob_index.end(); iter++) {
-			dc = iter->second;
-			unsorted_index.write((char *)dc, sizeof(struct eblob_disk_control));
+		if (temp_dir.empty()) {
+			temp_dir = fs::path(output).parent_path().string();
+			if (temp_dir.empty())
+				temp_dir = ".";
 		}
 
-		unsorted_index.close();
-		file_.close();
+		if (stat(input.c_str(), &st))
+			throw std::runtime_error(input + ": " + strerror(errno));
+
+		mem_limit *= 1024 * 1024;
+		thread_num = std::max(thread_num, 1);
+
+		index_writer out(output);
+		uint64_t loaded;
+
+		/* mapped index and two sort arrays */
+		if (!mem_limit || (uint64_t)st.st_size / sizeof(struct eblob_disk_control) *
+				(sizeof(struct eblob_disk_control) + 2 * sizeof(index_entry)) <= mem_limit)
+			loaded = sort_in_memory(input, out, thread_num);
+		else
+			loaded = sort_external(input, out, mem_limit, temp_dir, thread_num);
+
+		out.close();
 
+		std::cout << "loaded " << loaded << " elements, written " << out.written() << std::endl;
 	} catch (const std::exception &e) {
 		std::cerr << "Exiting: " << e.what() << std::endl;
 		return -1;
@@ -14,21 +14,38 @@
  * GNU General Public License for more details.
  */
 
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DNET_SCAN_AVX2
+#include <immintrin.h>
+#endif
 
 #include <elliptics/packet.h>
 #include <elliptics/interface.h>
 
+#include <eblob/blob.h>
+
 #include "common.h"
 
 
-int dnet_create_write_meta(struct dnet_meta_create_control *ctl, void **data)
+int dnet_create_meta_size(struct dnet_meta_create_control *ctl)
 {
-	struct dnet_meta_container mc;
-	struct dnet_meta_check_status *c;
-	struct dnet_meta_checksum *csum;
-	struct dnet_meta *m;
-	int size = 0, err, nsize = 0;
+	int size = 0;
 
 	size += sizeof(struct dnet_meta_check_status) + sizeof(struct dnet_meta);
 
@@ -42,119 +59,278 @@ int dnet_create_write_meta(struct dnet_meta_create_control *ctl, void **data)
 
 	size += sizeof(struct dnet_meta_update) + sizeof(struct dnet_meta);
 
-	if (!size) {
-		err = -EINVAL;
-		goto err_out_exit;
-	}
+	return size;
+}
 
-	memset(&mc, 0, sizeof(struct dnet_meta_container));
-	mc.data = malloc(size);
-	if (!mc.data) {
-		err = -ENOMEM;
-		goto err_out_exit;
+#ifdef WORDS_BIGENDIAN
+/*
+ * Converts every entry of host order container @data in one walk, sizes
+ * are read before entry headers are swapped.
+ */
+void dnet_meta_container_to_wire(void *data, unsigned int size)
+{
+	struct dnet_meta *m;
+	uint32_t esize, i;
+
+	while (size >= sizeof(struct dnet_meta)) {
+		m = data;
+		esize = m->size;
+
+		if (esize > size - sizeof(struct dnet_meta))
+			break;
+
+		switch (m->type) {
+			case DNET_META_UPDATE:
+				for (i = 0; i + sizeof(struct dnet_meta_update) <= esize; i += sizeof(struct dnet_meta_update))
+					dnet_convert_meta_update((struct dnet_meta_update *)(m->data + i));
+				break;
+
+			case DNET_META_CHECKSUM:
+				if (esize >= sizeof(struct dnet_meta_checksum))
+					dnet_convert_meta_checksum((struct dnet_meta_checksum *)m->data);
+				break;
+		}
+
+		dnet_convert_meta(m);
+
+		data += esize + sizeof(struct dnet_meta);
+		size -= esize + sizeof(struct dnet_meta);
 	}
-	memset(mc.data, 0, size);
+}
+#endif
 
-	m = (struct dnet_meta *)(mc.data);
+/*
+ * Builds meta container in caller provided buffer. Only fixed-size entries
+ * are zeroed, object name and groups are copied over as is. Container is
+ * filled in host order and converted once at the end.
+ * Returns container size or -ENOBUFS if @buf is too small.
+ */
+int dnet_create_write_meta_buf(struct dnet_meta_create_control *ctl, void *buf, int buf_size)
+{
+	struct dnet_meta_checksum *csum;
+	struct dnet_meta_update *mu;
+	struct dnet_meta *m;
+	int size;
 
-	c = (struct dnet_meta_check_status *)m->data;
-	m->size = sizeof(struct dnet_meta_check_status);
-	m->type = DNET_META_CHECK_STATUS;
+	size = dnet_create_meta_size(ctl);
+	if (size > buf_size)
+		return -ENOBUFS;
+
+	m = (struct dnet_meta *)buf;
 
 	/* Check status is undefined for now, it will be filled during actual check */
-	memset(c, 0, sizeof(struct dnet_meta_check_status));
-	dnet_convert_meta(m);
+	memset(m, 0, sizeof(struct dnet_meta) + sizeof(struct dnet_meta_check_status));
+	m->size = sizeof(struct dnet_meta_check_status);
+	m->type = DNET_META_CHECK_STATUS;
 
-	m = (struct dnet_meta *)(m->data + m->size);
-	dnet_create_meta_update(m, ctl->ts.tv_sec ? &ctl->ts : NULL, 0, 0);
+	m = (struct dnet_meta *)(m->data + sizeof(struct dnet_meta_check_status));
+	memset(m, 0, sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update));
+	mu = (struct dnet_meta_update *)m->data;
+	if (ctl->update_ts.tv_sec) {
+		mu->tm.tsec = ctl->update_ts.tv_sec;
+		mu->tm.tnsec = ctl->update_ts.tv_nsec;
+	} else if (ctl->ts.tv_sec) {
+		mu->tm.tsec = ctl->ts.tv_sec;
+		mu->tm.tnsec = ctl->ts.tv_nsec;
+	} else {
+		dnet_current_time(&mu->tm);
+	}
+	mu->flags = ctl->update_flags;
+	m->size = sizeof(struct dnet_meta_update);
+	m->type = DNET_META_UPDATE;
 
-	m = (struct dnet_meta *)(m->data + m->size);
+	m = (struct dnet_meta *)(m->data + sizeof(struct dnet_meta_update));
 
 	if (ctl->obj && ctl->len) {
+		memset(m, 0, sizeof(struct dnet_meta));
 		m->size = ctl->len;
 		m->type = DNET_META_PARENT_OBJECT;
 		memcpy(m->data, ctl->obj, ctl->len);
-		dnet_convert_meta(m);
 
-		m = (struct dnet_meta *)(m->data + m->size);
+		m = (struct dnet_meta *)(m->data + ctl->len);
 	}
 
 	if (ctl->groups && ctl->group_num) {
+		memset(m, 0, sizeof(struct dnet_meta));
 		m->size = ctl->group_num * sizeof(int);
 		m->type = DNET_META_GROUPS;
 		memcpy(m->data, ctl->groups, ctl->group_num * sizeof(int));
-		dnet_convert_meta(m);
 
-		m = (struct dnet_meta *)(m->data + m->size);
+		m = (struct dnet_meta *)(m->data + ctl->group_num * sizeof(int));
 	}
 
+	memset(m, 0, sizeof(struct dnet_meta) + sizeof(struct dnet_meta_checksum));
 	csum = (struct dnet_meta_checksum *)m->data;
 	memcpy(csum, ctl->checksum, DNET_CSUM_SIZE);
 	csum->tm.tsec = ctl->ts.tv_sec;
 	csum->tm.tnsec = ctl->ts.tv_nsec;
-	dnet_convert_meta_checksum(csum);
 	m->size = sizeof(struct dnet_meta_checksum);
 	m->type = DNET_META_CHECKSUM;
-	m = (struct dnet_meta *)(m->data + m->size);
-	dnet_convert_meta(m);
 
-	mc.size = size;
-	memcpy(&mc.id, &ctl->id, sizeof(struct dnet_id));
+	dnet_meta_container_to_wire(buf, size);
+	return size;
+}
+
+int dnet_create_write_meta(struct dnet_meta_create_control *ctl, void **data)
+{
+	void *buf;
+	int size, err;
+
+	size = dnet_create_meta_size(ctl);
+
+	buf = malloc(size);
+	if (!buf) {
+		err = -ENOMEM;
+		goto err_out_exit;
+	}
+
+	err = dnet_create_write_meta_buf(ctl, buf, size);
+	if (err < 0)
+		goto err_out_free;
 
-	*data = mc.data;
-	return mc.size;
+	*data = buf;
+	return err;
 
+err_out_free:
+	free(buf);
 err_out_exit:
 	return err;
 }
 
-struct dnet_meta * dnet_meta_search_cust(struct dnet_meta_container *mc, uint32_t type)
+/*
+ * Returns scratch buffer of at least @size bytes. Arena is grown only when
+ * bigger record shows up, so hot path does not touch the allocator.
+ */
+void *dnet_meta_arena_reserve(struct dnet_meta_arena *a, int size)
+{
+	void *data;
+
+	if (size <= a->size)
+		return a->data;
+
+	if (size < DNET_META_ARENA_SIZE)
+		size = DNET_META_ARENA_SIZE;
+
+	data = realloc(a->data, size);
+	if (!data)
+		return NULL;
+
+	a->data = data;
+	a->size = size;
+	return data;
+}
+
+void dnet_meta_arena_destroy(struct dnet_meta_arena *a)
+{
+	free(a->data);
+	a->data = NULL;
+	a->size = 0;
+}
+
+/*
+ * Walks container once and remembers the first entry of every known type,
+ * or the last one with DNET_META_VIEW_LAST.
+ * Returns 0 or -EINVAL if container is broken, entries before the broken
+ * one are still indexed.
+ */
+int dnet_meta_view_init(struct dnet_meta_view *v, void *data, unsigned int size, int flags)
 {
-	void *data = mc->data;
-	uint32_t size = mc->size;
-	struct dnet_meta m, *found = NULL;
+	struct dnet_meta *m;
+	uint32_t type, esize;
+
+	memset(v, 0, sizeof(struct dnet_meta_view));
 
 	while (size) {
 		if (size < sizeof(struct dnet_meta)) {
-			fprintf(stderr, "Metadata size %u is too small, min %zu, searching for 0x%x.\n",
-					size, sizeof(struct dnet_meta), type);
-			break;
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Metadata size %u is too small, min %zu.\n",
+					size, sizeof(struct dnet_meta));
+			return -EINVAL;
 		}
 
-		m = *(struct dnet_meta *)data;
-		dnet_convert_meta(&m);
+		m = data;
+		type = dnet_bswap32(m->type);
+		esize = dnet_bswap32(m->size);
 
-		if (m.size + sizeof(struct dnet_meta) > size) {
-			fprintf(stderr, "Metadata entry broken: entry size %u, type: 0x%x, struct size: %zu, "
-					"total size left: %u, searching for 0x%x.\n",
-					m.size, m.type, sizeof(struct dnet_meta), size, type);
-			break;
+		if (esize > size - sizeof(struct dnet_meta)) {
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Metadata entry broken: entry size %u, type: 0x%x, struct size: %zu, "
+					"total size left: %u.\n", esize, type, sizeof(struct dnet_meta), size);
+			return -EINVAL;
 		}
 
-		if (m.type == type) {
-			found = data;
-			break;
+		if (type < __DNET_META_MAX && (!v->entry[type] || (flags & DNET_META_VIEW_LAST))) {
+			v->entry[type] = m;
+			v->size[type] = esize;
 		}
 
-		data += m.size + sizeof(struct dnet_meta);
-		size -= m.size + sizeof(struct dnet_meta);
+		data += esize + sizeof(struct dnet_meta);
+		size -= esize + sizeof(struct dnet_meta);
 	}
 
-	return found;
+	return 0;
+}
+
+struct dnet_meta *dnet_meta_view_find(const struct dnet_meta_view *v, uint32_t type)
+{
+	return type < __DNET_META_MAX ? v->entry[type] : NULL;
+}
+
+char *dnet_meta_view_parent(const struct dnet_meta_view *v, int *len)
+{
+	struct dnet_meta *m = v->entry[DNET_META_PARENT_OBJECT];
+
+	if (!m)
+		return NULL;
+
+	*len = v->size[DNET_META_PARENT_OBJECT];
+	return (char *)m->data;
+}
+
+int *dnet_meta_view_groups(const struct dnet_meta_view *v, int *group_num)
+{
+	struct dnet_meta *m = v->entry[DNET_META_GROUPS];
+
+	if (!m)
+		return NULL;
+
+	*group_num = v->size[DNET_META_GROUPS] / sizeof(int);
+	return (int *)m->data;
+}
+
+struct dnet_meta_checksum *dnet_meta_view_checksum(const struct dnet_meta_view *v)
+{
+	struct dnet_meta *m = v->entry[DNET_META_CHECKSUM];
+
+	if (!m || v->size[DNET_META_CHECKSUM] < sizeof(struct dnet_meta_checksum))
+		return NULL;
+
+	return (struct dnet_meta_checksum *)m->data;
+}
+
+struct dnet_meta_update *dnet_meta_view_update(const struct dnet_meta_view *v)
+{
+	struct dnet_meta *m = v->entry[DNET_META_UPDATE];
+
+	if (!m || v->size[DNET_META_UPDATE] < sizeof(struct dnet_meta_update))
+		return NULL;
+
+	return (struct dnet_meta_update *)m->data;
 }
 
 void dnet_common_log(void *priv __attribute((unused)), uint32_t mask, const char *msg)
 {
-        char str[64];
-        struct tm tm;
-        struct timeval tv;
+	char str[64];
+	struct tm tm;
+	struct timeval tv;
+	int level = (mask & EBLOB_LOG_ERROR) ? DNET_CONV_LOG_ERROR : DNET_CONV_LOG_SUMMARY;
 
-        gettimeofday(&tv, NULL);
-        localtime_r((time_t *)&tv.tv_sec, &tm);
-        strftime(str, sizeof(str), "%F %R:%S", &tm);
+	if (level > dnet_conv_log_level)
+		return;
 
-        fprintf(stderr, "%s.%06lu %1x: %s", str, tv.tv_usec, mask, msg);
-	fflush(stderr);
+	gettimeofday(&tv, NULL);
+	localtime_r((time_t *)&tv.tv_sec, &tm);
+	strftime(str, sizeof(str), "%F %R:%S", &tm);
+
+	dnet_conv_log_raw(level, "%s.%06lu %1x: %s", str, tv.tv_usec, mask, msg);
 }
 
 int dnet_parse_groups(char *value, int **groupsp)
@@ -212,4 +388,1628 @@ int dnet_parse_groups(char *value, int **groupsp)
 	return pos;
 }
 
+int dnet_parse_shard(const char *value, struct dnet_shard *shard)
+{
+	unsigned int index, num;
+	char tail;
+
+	if (sscanf(value, "%u/%u%c", &index, &num, &tail) != 2 || !num || index >= num) {
+		fprintf(stderr, "invalid shard '%s', expected i/N with i < N\n", value);
+		return -EINVAL;
+	}
+
+	shard->index = index;
+	shard->num = num;
+	return 0;
+}
+
+static uint64_t dnet_shard_prefix(const void *key, size_t size)
+{
+	const unsigned char *k = key;
+	uint64_t prefix = 0;
+	size_t i;
+
+	for (i = 0; i < 8; ++i)
+		prefix = (prefix << 8) | (i < size ? k[i] : 0);
+
+	return prefix;
+}
+
+int dnet_shard_match(const struct dnet_shard *shard, const void *key, size_t size)
+{
+	if (shard->num <= 1)
+		return 1;
+
+	return dnet_shard_prefix(key, size) / (UINT64_MAX / shard->num + 1) == shard->index;
+}
+
+int dnet_shard_slot(const struct dnet_shard *shard, const void *key, size_t size, int num)
+{
+	uint64_t prefix = dnet_shard_prefix(key, size);
+	uint64_t width;
+
+	if (shard->num <= 1)
+		return prefix / (UINT64_MAX / num + 1);
+
+	/* position within the shard's range, then the same split once more */
+	width = UINT64_MAX / shard->num + 1;
+	return (prefix % width) / (width / num + 1);
+}
+
+int dnet_job_queue_init(struct dnet_job_queue *q, int size)
+{
+	int err;
+
+	memset(q, 0, sizeof(struct dnet_job_queue));
+
+	q->ring = malloc(size * sizeof(void *));
+	if (!q->ring) {
+		err = -ENOMEM;
+		goto err_out_exit;
+	}
+	q->size = size;
+
+	err = -pthread_mutex_init(&q->lock, NULL);
+	if (err)
+		goto err_out_free;
+
+	err = -pthread_cond_init(&q->wait, NULL);
+	if (err)
+		goto err_out_destroy_lock;
+
+	err = -pthread_cond_init(&q->room, NULL);
+	if (err)
+		goto err_out_destroy_wait;
+
+	return 0;
+
+err_out_destroy_wait:
+	pthread_cond_destroy(&q->wait);
+err_out_destroy_lock:
+	pthread_mutex_destroy(&q->lock);
+err_out_free:
+	free(q->ring);
+err_out_exit:
+	return err;
+}
+
+void dnet_job_queue_destroy(struct dnet_job_queue *q)
+{
+	pthread_cond_destroy(&q->room);
+	pthread_cond_destroy(&q->wait);
+	pthread_mutex_destroy(&q->lock);
+	free(q->ring);
+}
+
+/*
+ * Blocks while queue is full. Returns -EPIPE if queue was closed,
+ * caller still owns @job in that case.
+ */
+int dnet_job_queue_push(struct dnet_job_queue *q, void *job)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->num == q->size && !q->closed)
+		pthread_cond_wait(&q->room, &q->lock);
+
+	if (q->closed) {
+		err = -EPIPE;
+		goto err_out_unlock;
+	}
+
+	q->ring[(q->head + q->num) % q->size] = job;
+	q->num++;
+	pthread_cond_signal(&q->wait);
+
+err_out_unlock:
+	pthread_mutex_unlock(&q->lock);
+	return err;
+}
+
+/*
+ * Blocks while queue is empty. Returns NULL when queue is closed and drained.
+ */
+void *dnet_job_queue_pop(struct dnet_job_queue *q)
+{
+	void *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->num && !q->closed)
+		pthread_cond_wait(&q->wait, &q->lock);
+
+	if (q->num) {
+		job = q->ring[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->num--;
+		pthread_cond_signal(&q->room);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+/*
+ * Takes up to @max jobs at once. Returns 0 when queue is closed and drained.
+ */
+int dnet_job_queue_pop_batch(struct dnet_job_queue *q, void **jobs, int max)
+{
+	int num = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->num && !q->closed)
+		pthread_cond_wait(&q->wait, &q->lock);
+
+	while (q->num && num < max) {
+		jobs[num++] = q->ring[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->num--;
+	}
+
+	if (num)
+		pthread_cond_broadcast(&q->room);
+	pthread_mutex_unlock(&q->lock);
+
+	return num;
+}
+
+void dnet_job_queue_close(struct dnet_job_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->wait);
+	pthread_cond_broadcast(&q->room);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Write slots are allocated once at writer start and recycled through
+ * the free queue, their buffers only grow.
+ */
+struct dnet_meta_write {
+	struct dnet_raw_id		id;
+	unsigned int			size;
+	struct dnet_meta_arena		arena;
+};
+
+static int dnet_bulk_blob_close(struct dnet_bulk_blob *bb)
+{
+	int err = 0;
+
+	if (bb->data) {
+		if (fflush(bb->data) || fsync(fileno(bb->data)))
+			err = -errno;
+		if (fclose(bb->data) && !err)
+			err = -errno;
+		bb->data = NULL;
+	}
+
+	if (bb->index) {
+		if (fflush(bb->index) || fsync(fileno(bb->index)))
+			err = -errno;
+		if (fclose(bb->index) && !err)
+			err = -errno;
+		bb->index = NULL;
+	}
+
+	if (err)
+		fprintf(stderr, "%s.%d: failed to close bulk-loaded blob: %d.\n", bb->path, bb->num, err);
+
+	return err;
+}
+
+static FILE *dnet_bulk_blob_fopen(const char *name, char *buf)
+{
+	FILE *f;
+
+	/* target was checked to be empty, never overwrite what is not ours */
+	f = fopen(name, "wx");
+	if (!f)
+		return NULL;
+
+	setvbuf(f, buf, _IOFBF, DNET_BULK_BUF_SIZE);
+	return f;
+}
+
+static int dnet_bulk_blob_open(struct dnet_bulk_blob *bb, int num)
+{
+	char name[PATH_MAX];
+	int err;
+
+	snprintf(name, sizeof(name), "%s.%d", bb->path, num);
+	bb->data = dnet_bulk_blob_fopen(name, bb->data_buf);
+	if (!bb->data) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to create blob: %d.\n", name, err);
+		goto err_out_exit;
+	}
+
+	snprintf(name, sizeof(name), "%s.%d.index", bb->path, num);
+	bb->index = dnet_bulk_blob_fopen(name, bb->index_buf);
+	if (!bb->index) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to create index: %d.\n", name, err);
+		goto err_out_close;
+	}
+
+	bb->num = num;
+	bb->offset = 0;
+	bb->records = 0;
+	return 0;
+
+err_out_close:
+	fclose(bb->data);
+	bb->data = NULL;
+err_out_exit:
+	return err;
+}
+
+/*
+ * Bulk load is only allowed into empty eblob: there is no lookup for
+ * existing records, blob is written sequentially from the start.
+ */
+/*
+ * Failed bulk load removes every blob it has written, so none of
+ * <path>.N and <path>.N.index may exist beforehand.
+ */
+static int dnet_bulk_blob_check_empty(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *base, *p;
+	struct dirent *ent;
+	size_t len;
+	DIR *d;
+	int err = 0;
+
+	base = strrchr(path, '/');
+	if (base) {
+		snprintf(dir, sizeof(dir), "%.*s", base == path ? 1 : (int)(base - path), path);
+		base++;
+	} else {
+		snprintf(dir, sizeof(dir), ".");
+		base = path;
+	}
+
+	d = opendir(dir);
+	if (!d) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to open directory: %d.\n", dir, err);
+		goto err_out_exit;
+	}
+
+	len = strlen(base);
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, base, len) || ent->d_name[len] != '.')
+			continue;
+
+		p = ent->d_name + len + 1;
+		if (!isdigit((unsigned char)*p))
+			continue;
+		while (isdigit((unsigned char)*p))
+			p++;
+		if (*p && strcmp(p, ".index"))
+			continue;
+
+		fprintf(stderr, "%s/%s: exists, bulk load requires empty target.\n", dir, ent->d_name);
+		err = -EEXIST;
+		break;
+	}
+
+	closedir(d);
+err_out_exit:
+	return err;
+}
+
+int dnet_bulk_blob_init(struct dnet_bulk_blob *bb, const char *path)
+{
+	int err;
+
+	memset(bb, 0, sizeof(struct dnet_bulk_blob));
+
+	err = dnet_bulk_blob_check_empty(path);
+	if (err)
+		goto err_out_exit;
+
+	bb->path = strdup(path);
+	bb->data_buf = malloc(DNET_BULK_BUF_SIZE);
+	bb->index_buf = malloc(DNET_BULK_BUF_SIZE);
+	if (!bb->path || !bb->data_buf || !bb->index_buf) {
+		err = -ENOMEM;
+		goto err_out_free;
+	}
+
+	bb->blob_size = DNET_BULK_BLOB_SIZE;
+	bb->records_in_blob = DNET_BULK_RECORDS_IN_BLOB;
+
+	err = dnet_bulk_blob_open(bb, 0);
+	if (err)
+		goto err_out_free;
+
+	return 0;
+
+err_out_free:
+	free(bb->index_buf);
+	free(bb->data_buf);
+	free(bb->path);
+err_out_exit:
+	return err;
+}
+
+/*
+ * Blob with a failed write is not finalized: records after the failure are
+ * missing and data file may hold a partial one, so all files are removed
+ * and bulk load has to be restarted into empty target.
+ */
+int dnet_bulk_blob_cleanup(struct dnet_bulk_blob *bb)
+{
+	char name[PATH_MAX];
+	int err, i;
+
+	err = dnet_bulk_blob_close(bb);
+	if (bb->failed)
+		err = bb->failed;
+
+	if (err) {
+		for (i = 0; i <= bb->num; ++i) {
+			snprintf(name, sizeof(name), "%s.%d", bb->path, i);
+			unlink(name);
+			snprintf(name, sizeof(name), "%s.%d.index", bb->path, i);
+			unlink(name);
+		}
+
+		fprintf(stderr, "%s: bulk load failed: %d, partial blob removed.\n", bb->path, err);
+	}
+
+	free(bb->index_buf);
+	free(bb->data_buf);
+	free(bb->path);
+
+	return err;
+}
 
+/*
+ * Appends record to the data file and its control structure to the index,
+ * both through large stdio buffers. Index is produced in the same pass in
+ * position order, exactly what eblob itself would have written.
+ */
+int dnet_bulk_blob_write(struct dnet_bulk_blob *bb, struct dnet_raw_id *id, void *data, unsigned int size)
+{
+	struct eblob_disk_control dc;
+	uint64_t disk_size = sizeof(struct eblob_disk_control) + size;
+	int err;
+
+	if (bb->failed)
+		return bb->failed;
+
+	if (bb->records && (bb->records >= bb->records_in_blob || bb->offset + disk_size > bb->blob_size)) {
+		err = dnet_bulk_blob_close(bb);
+		if (err)
+			goto err_out_fail;
+
+		err = dnet_bulk_blob_open(bb, bb->num + 1);
+		if (err)
+			goto err_out_fail;
+	}
+
+	memset(&dc, 0, sizeof(struct eblob_disk_control));
+	memcpy(dc.key.id, id->id, sizeof(dc.key.id));
+	dc.flags = BLOB_DISK_CTL_NOCSUM;
+	dc.data_size = size;
+	dc.disk_size = disk_size;
+	dc.position = bb->offset;
+	eblob_convert_disk_control(&dc);
+
+	errno = 0;
+	if (fwrite(&dc, sizeof(struct eblob_disk_control), 1, bb->data) != 1 ||
+			fwrite(data, size, 1, bb->data) != 1 ||
+			fwrite(&dc, sizeof(struct eblob_disk_control), 1, bb->index) != 1) {
+		/* short write does not have to set errno */
+		err = errno ? -errno : -EIO;
+		goto err_out_fail;
+	}
+
+	bb->offset += disk_size;
+	bb->records++;
+	return 0;
+
+err_out_fail:
+	bb->failed = err;
+	return err;
+}
+
+static void *dnet_meta_writer_process(void *priv)
+{
+	struct dnet_meta_writer *w = priv;
+	struct dnet_meta_write *batch[DNET_META_WRITER_BATCH];
+	int num, err, i;
+
+	while ((num = dnet_job_queue_pop_batch(&w->queue, (void **)batch, DNET_META_WRITER_BATCH)) > 0) {
+		for (i = 0; i < num; ++i) {
+			uint64_t start = dnet_conv_stat_start();
+
+			if (w->bulk)
+				err = dnet_bulk_blob_write(w->bulk, &batch[i]->id, batch[i]->arena.data, batch[i]->size);
+			else
+				err = dnet_db_write_raw(w->backend, &batch[i]->id, batch[i]->arena.data, batch[i]->size);
+			dnet_conv_stat_end(DNET_CONV_STAT_META_WRITE, start);
+			if (err) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "%s: failed to write new meta, err %d.\n",
+						dnet_dump_id_str(batch[i]->id.id), err);
+				__atomic_store_n(&w->errors, w->errors + 1, __ATOMIC_RELEASE);
+
+				/* records after failed bulk write would point to wrong offsets */
+				if (w->bulk && !w->failed)
+					__atomic_store_n(&w->failed, err, __ATOMIC_RELEASE);
+			} else {
+				__atomic_store_n(&w->written, w->written + 1, __ATOMIC_RELEASE);
+			}
+
+			dnet_job_queue_push(&w->free, batch[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static void dnet_meta_writer_free_slots(struct dnet_meta_writer *w)
+{
+	struct dnet_meta_write *mw;
+
+	dnet_job_queue_close(&w->free);
+	while ((mw = dnet_job_queue_pop(&w->free)) != NULL) {
+		dnet_meta_arena_destroy(&mw->arena);
+		free(mw);
+	}
+	dnet_job_queue_destroy(&w->free);
+}
+
+int dnet_meta_writer_start(struct dnet_meta_writer *w, struct eblob_backend *b,
+		struct dnet_bulk_blob *bulk, int queue_size)
+{
+	struct dnet_meta_write *mw;
+	int err, i;
+
+	memset(w, 0, sizeof(struct dnet_meta_writer));
+	w->backend = b;
+	w->bulk = bulk;
+	w->dry_run = !b && !bulk;
+
+	if (w->dry_run)
+		return 0;
+
+	err = dnet_job_queue_init(&w->free, queue_size);
+	if (err)
+		goto err_out_exit;
+
+	for (i = 0; i < queue_size; ++i) {
+		mw = calloc(1, sizeof(struct dnet_meta_write));
+		if (!mw) {
+			err = -ENOMEM;
+			goto err_out_free_slots;
+		}
+
+		dnet_job_queue_push(&w->free, mw);
+	}
+
+	err = dnet_job_queue_init(&w->queue, queue_size);
+	if (err)
+		goto err_out_free_slots;
+
+	err = -pthread_create(&w->tid, NULL, dnet_meta_writer_process, w);
+	if (err)
+		goto err_out_destroy;
+
+	return 0;
+
+err_out_destroy:
+	dnet_job_queue_destroy(&w->queue);
+err_out_free_slots:
+	dnet_meta_writer_free_slots(w);
+err_out_exit:
+	return err;
+}
+
+/*
+ * Copies @data into a free write slot and queues it, caller keeps @data.
+ * Blocks when all slots are in flight.
+ */
+int dnet_meta_writer_queue(struct dnet_meta_writer *w, struct dnet_raw_id *id, void *data, unsigned int size)
+{
+	struct dnet_meta_write *mw;
+	void *buf;
+	int err;
+
+	if (w->dry_run) {
+		__atomic_fetch_add(&w->queued, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->queued_bytes, size, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->written, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	err = __atomic_load_n(&w->failed, __ATOMIC_ACQUIRE);
+	if (err)
+		goto err_out_exit;
+
+	mw = dnet_job_queue_pop(&w->free);
+	if (!mw) {
+		err = -EPIPE;
+		goto err_out_exit;
+	}
+
+	buf = dnet_meta_arena_reserve(&mw->arena, size);
+	if (!buf) {
+		err = -ENOMEM;
+		goto err_out_put;
+	}
+
+	memcpy(&mw->id, id, sizeof(struct dnet_raw_id));
+	memcpy(buf, data, size);
+	mw->size = size;
+
+	err = dnet_job_queue_push(&w->queue, mw);
+	if (err)
+		goto err_out_put;
+
+	__atomic_fetch_add(&w->queued_bytes, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->queued, 1, __ATOMIC_RELEASE);
+	return 0;
+
+err_out_put:
+	dnet_job_queue_push(&w->free, mw);
+err_out_exit:
+	return err;
+}
+
+/*
+ * Flushes everything queued so far and stops writer thread.
+ */
+void dnet_meta_writer_stop(struct dnet_meta_writer *w)
+{
+	if (w->dry_run)
+		return;
+
+	dnet_job_queue_close(&w->queue);
+	pthread_join(w->tid, NULL);
+	dnet_job_queue_destroy(&w->queue);
+	dnet_meta_writer_free_slots(w);
+}
+
+/*
+ * Flags live at fixed stride in the index; live positions are compacted
+ * without a branch per record.
+ */
+static int dnet_eblob_scan_live_range(const unsigned char *flags, int i, int num, uint16_t *live, int n)
+{
+	const int stride = sizeof(struct eblob_disk_control);
+	uint64_t f;
+
+	for (; i < num; ++i) {
+		memcpy(&f, flags + i * stride, sizeof(f));
+
+		live[n] = i;
+		n += !(le64toh(f) & BLOB_DISK_CTL_REMOVE);
+	}
+
+	return n;
+}
+
+#ifdef DNET_SCAN_AVX2
+/*
+ * Built for AVX2 regardless of the global -m flags and only called when the
+ * CPU reports support: four flags are gathered at once and the remove bit is
+ * turned into a 4-bit live mask.
+ */
+__attribute__((target("avx2")))
+static int dnet_eblob_scan_live_avx2(const unsigned char *flags, int num, uint16_t *live)
+{
+	const int stride = sizeof(struct eblob_disk_control);
+	const __m256i offsets = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+	const __m256i remove = _mm256_set1_epi64x(BLOB_DISK_CTL_REMOVE);
+	const __m256i zero = _mm256_setzero_si256();
+	int i = 0, n = 0;
+
+	for (; i + 4 <= num; i += 4) {
+		__m256i v = _mm256_i64gather_epi64((const long long *)(flags + i * stride), offsets, 1);
+		__m256i alive = _mm256_cmpeq_epi64(_mm256_and_si256(v, remove), zero);
+		unsigned int live_mask = _mm256_movemask_pd(_mm256_castsi256_pd(alive));
+
+		live[n] = i;
+		n += live_mask & 1;
+		live[n] = i + 1;
+		n += (live_mask >> 1) & 1;
+		live[n] = i + 2;
+		n += (live_mask >> 2) & 1;
+		live[n] = i + 3;
+		n += (live_mask >> 3) & 1;
+	}
+
+	return dnet_eblob_scan_live_range(flags, i, num, live, n);
+}
+#endif
+
+int dnet_eblob_scan_live(const void *index, int num, uint16_t *live)
+{
+	const unsigned char *flags = (const unsigned char *)index + offsetof(struct eblob_disk_control, flags);
+
+#ifdef DNET_SCAN_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return dnet_eblob_scan_live_avx2(flags, num, live);
+#endif
+
+	return dnet_eblob_scan_live_range(flags, 0, num, live, 0);
+}
+
+uint64_t dnet_meta_index_prefix(const unsigned char *id)
+{
+	uint64_t prefix = 0;
+	int i;
+
+	for (i = 0; i < 8; ++i)
+		prefix = (prefix << 8) | id[i];
+
+	return prefix;
+}
+
+static int dnet_meta_index_cmp(const void *p1, const void *p2)
+{
+	const struct dnet_meta_index_entry *e1 = p1, *e2 = p2;
+
+	if (e1->prefix != e2->prefix)
+		return e1->prefix < e2->prefix ? -1 : 1;
+	if (e1->loc != e2->loc)
+		return e1->loc < e2->loc ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Reads one index file sequentially, removed records are skipped.
+ */
+static int dnet_meta_index_load(struct dnet_meta_index *idx, const char *name, int num)
+{
+	struct eblob_disk_control dc, *block;
+	struct dnet_meta_index_entry *ent;
+	uint16_t live[DNET_EBLOB_SCAN_BLOCK];
+	struct stat st;
+	uint64_t max;
+	size_t nr;
+	int live_num, i;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(name, "r");
+	if (!f) {
+		err = -errno;
+		goto err_out_exit;
+	}
+
+	if (fstat(fileno(f), &st)) {
+		err = -errno;
+		goto err_out_close;
+	}
+
+	max = idx->num + st.st_size / sizeof(struct eblob_disk_control);
+	ent = realloc(idx->ent, max * sizeof(struct dnet_meta_index_entry) + 1);
+	if (!ent) {
+		err = -ENOMEM;
+		goto err_out_close;
+	}
+	idx->ent = ent;
+
+	block = malloc(DNET_EBLOB_SCAN_BLOCK * sizeof(struct eblob_disk_control));
+	if (!block) {
+		err = -ENOMEM;
+		goto err_out_close;
+	}
+
+	while ((nr = fread(block, sizeof(struct eblob_disk_control), DNET_EBLOB_SCAN_BLOCK, f)) > 0) {
+		live_num = dnet_eblob_scan_live(block, nr, live);
+
+		for (i = 0; i < live_num && idx->num < max; ++i) {
+			dc = block[live[i]];
+			eblob_convert_disk_control(&dc);
+
+			ent = &idx->ent[idx->num++];
+			ent->prefix = dnet_meta_index_prefix(dc.key.id);
+			ent->loc = ((uint64_t)num << DNET_META_INDEX_LOC_SHIFT) | dc.position;
+		}
+	}
+
+	if (ferror(f))
+		err = -EIO;
+
+	free(block);
+err_out_close:
+	fclose(f);
+err_out_exit:
+	if (err)
+		fprintf(stderr, "%s: failed to load index: %d.\n", name, err);
+	return err;
+}
+
+/*
+ * Loads every <path>.N.index, opens matching data files and sorts entries.
+ */
+int dnet_meta_index_build(struct dnet_meta_index *idx, const char *path)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	int *fds, fd, err;
+
+	memset(idx, 0, sizeof(struct dnet_meta_index));
+
+	while (1) {
+		snprintf(name, sizeof(name), "%s.%d.index", path, idx->blob_num);
+		if (stat(name, &st))
+			break;
+
+		err = dnet_meta_index_load(idx, name, idx->blob_num);
+		if (err)
+			goto err_out_destroy;
+
+		snprintf(name, sizeof(name), "%s.%d", path, idx->blob_num);
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			err = -errno;
+			fprintf(stderr, "%s: failed to open blob: %d.\n", name, err);
+			goto err_out_destroy;
+		}
+
+		fds = realloc(idx->fds, (idx->blob_num + 1) * sizeof(int));
+		if (!fds) {
+			close(fd);
+			err = -ENOMEM;
+			goto err_out_destroy;
+		}
+
+		idx->fds = fds;
+		idx->fds[idx->blob_num++] = fd;
+	}
+
+	qsort(idx->ent, idx->num, sizeof(struct dnet_meta_index_entry), dnet_meta_index_cmp);
+	return 0;
+
+err_out_destroy:
+	dnet_meta_index_destroy(idx);
+	return err;
+}
+
+void dnet_meta_index_destroy(struct dnet_meta_index *idx)
+{
+	int i;
+
+	for (i = 0; i < idx->blob_num; ++i)
+		close(idx->fds[i]);
+
+	free(idx->fds);
+	free(idx->ent);
+	memset(idx, 0, sizeof(struct dnet_meta_index));
+}
+
+/*
+ * Returns the first entry with prefix not less than @prefix.
+ */
+uint64_t dnet_meta_index_lower_bound(struct dnet_meta_index *idx, uint64_t prefix)
+{
+	uint64_t lo = 0, hi = idx->num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (idx->ent[mid].prefix < prefix)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Reads record at @loc into @arena if it still holds key @id.
+ * Returns record size or -ENOENT on fingerprint collision or removed record.
+ */
+int dnet_meta_index_read(struct dnet_meta_index *idx, uint64_t loc, const unsigned char *id,
+		struct dnet_meta_arena *arena)
+{
+	struct eblob_disk_control dc;
+	int blob = loc >> DNET_META_INDEX_LOC_SHIFT;
+	uint64_t pos = loc & DNET_META_INDEX_POS_MASK;
+	ssize_t err;
+
+	if (blob >= idx->blob_num)
+		return -EINVAL;
+
+	err = pread(idx->fds[blob], &dc, sizeof(struct eblob_disk_control), pos);
+	if (err != sizeof(struct eblob_disk_control))
+		return err < 0 ? -errno : -EIO;
+
+	eblob_convert_disk_control(&dc);
+
+	if ((dc.flags & BLOB_DISK_CTL_REMOVE) || memcmp(dc.key.id, id, DNET_ID_SIZE))
+		return -ENOENT;
+
+	if (dc.data_size > INT_MAX || !dnet_meta_arena_reserve(arena, dc.data_size))
+		return -ENOMEM;
+
+	err = pread(idx->fds[blob], arena->data, dc.data_size, pos + sizeof(struct eblob_disk_control));
+	if (err != (ssize_t)dc.data_size)
+		return err < 0 ? -errno : -EIO;
+
+	return dc.data_size;
+}
+
+/*
+ * Existence check without I/O: key is reported present if its fingerprint
+ * is in the index. Distinct keys share 8-byte fingerprint with probability
+ * about num / 2^64, callers which need the record read and verify it.
+ */
+int dnet_meta_index_exists(struct dnet_meta_index *idx, const unsigned char *id)
+{
+	uint64_t prefix = dnet_meta_index_prefix(id);
+	uint64_t pos = dnet_meta_index_lower_bound(idx, prefix);
+
+	return pos < idx->num && idx->ent[pos].prefix == prefix;
+}
+
+/*
+ * Reads record of @id into @arena, returns its size or -ENOENT.
+ */
+int dnet_meta_index_lookup(struct dnet_meta_index *idx, const unsigned char *id, struct dnet_meta_arena *arena)
+{
+	uint64_t prefix = dnet_meta_index_prefix(id);
+	uint64_t pos;
+	int err;
+
+	/* fingerprints may collide, full key is checked on read */
+	for (pos = dnet_meta_index_lower_bound(idx, prefix); pos < idx->num && idx->ent[pos].prefix == prefix; ++pos) {
+		err = dnet_meta_index_read(idx, idx->ent[pos].loc, id, arena);
+		if (err != -ENOENT)
+			return err;
+	}
+
+	return -ENOENT;
+}
+
+int dnet_checkpoint_init(struct dnet_checkpoint *c, const char *path, struct dnet_meta_writer *w, int sync_delay)
+{
+	memset(c, 0, sizeof(struct dnet_checkpoint));
+
+	c->path = strdup(path);
+	if (!c->path)
+		return -ENOMEM;
+
+	c->writer = w;
+	c->sync_delay = sync_delay;
+	c->stamp = time(NULL);
+	return 0;
+}
+
+/*
+ * Checkpoint is only useful while conversion is incomplete.
+ */
+void dnet_checkpoint_cleanup(struct dnet_checkpoint *c, int finished)
+{
+	if (finished)
+		unlink(c->path);
+
+	free(c->path);
+	c->path = NULL;
+}
+
+int dnet_checkpoint_load(const char *path, struct dnet_checkpoint_data *d)
+{
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err = -errno;
+		goto err_out_exit;
+	}
+
+	err = read(fd, d, sizeof(struct dnet_checkpoint_data));
+	if (err != sizeof(struct dnet_checkpoint_data) || d->magic != DNET_CHECKPOINT_MAGIC ||
+			d->pos_size > DNET_CHECKPOINT_POS_SIZE) {
+		err = -EINVAL;
+		goto err_out_close;
+	}
+
+	err = 0;
+
+err_out_close:
+	close(fd);
+err_out_exit:
+	if (err)
+		fprintf(stderr, "%s: failed to load checkpoint: %d.\n", path, err);
+	return err;
+}
+
+static int dnet_checkpoint_write(struct dnet_checkpoint *c)
+{
+	char tmp[PATH_MAX];
+	int fd, err;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", c->path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto err_out_exit;
+	}
+
+	if (write(fd, &c->data, sizeof(struct dnet_checkpoint_data)) != sizeof(struct dnet_checkpoint_data) ||
+			fsync(fd)) {
+		err = errno ? -errno : -EIO;
+		goto err_out_close;
+	}
+
+	close(fd);
+
+	if (rename(tmp, c->path)) {
+		err = -errno;
+		goto err_out_exit;
+	}
+
+	return 0;
+
+err_out_close:
+	close(fd);
+	unlink(tmp);
+err_out_exit:
+	dnet_conv_log(DNET_CONV_LOG_ERROR, "%s: failed to write checkpoint: %d.\n", c->path, err);
+	return err;
+}
+
+int dnet_checkpoint_need(struct dnet_checkpoint *c)
+{
+	return c->state == DNET_CHECKPOINT_IDLE && time(NULL) >= c->stamp + DNET_CHECKPOINT_INTERVAL;
+}
+
+/*
+ * @pos is the first record not yet handed to workers, @processed counts
+ * records before it.
+ */
+void dnet_checkpoint_take(struct dnet_checkpoint *c, const void *pos, unsigned int size, uint64_t processed)
+{
+	if (size > DNET_CHECKPOINT_POS_SIZE)
+		return;
+
+	memset(&c->data, 0, sizeof(struct dnet_checkpoint_data));
+	c->data.magic = DNET_CHECKPOINT_MAGIC;
+	c->data.processed = processed;
+	c->data.pos_size = size;
+	memcpy(c->data.pos, pos, size);
+
+	c->state = DNET_CHECKPOINT_WORKERS;
+}
+
+int dnet_checkpoint_poll(struct dnet_checkpoint *c, int workers_done)
+{
+	uint64_t done;
+	int err = 0;
+
+	switch (c->state) {
+		case DNET_CHECKPOINT_WORKERS:
+			if (!workers_done)
+				break;
+
+			c->writer_mark = __atomic_load_n(&c->writer->queued, __ATOMIC_ACQUIRE);
+			c->state = DNET_CHECKPOINT_WRITER;
+			/* fall through */
+		case DNET_CHECKPOINT_WRITER:
+			done = __atomic_load_n(&c->writer->written, __ATOMIC_ACQUIRE) +
+				__atomic_load_n(&c->writer->errors, __ATOMIC_ACQUIRE);
+			if (done < c->writer_mark)
+				break;
+
+			c->stamp = time(NULL);
+			c->state = DNET_CHECKPOINT_SYNC;
+			/* fall through */
+		case DNET_CHECKPOINT_SYNC:
+			if (time(NULL) < c->stamp + c->sync_delay)
+				break;
+
+			err = dnet_checkpoint_write(c);
+			c->stamp = time(NULL);
+			c->state = DNET_CHECKPOINT_IDLE;
+			break;
+	}
+
+	return err;
+}
+
+int dnet_conv_stat_enabled;
+
+struct dnet_conv_stat_hist {
+	uint64_t			sum;
+	uint64_t			max;
+	uint64_t			bucket[DNET_CONV_STAT_BUCKETS];
+};
+
+struct dnet_conv_stat_thread {
+	struct dnet_conv_stat_thread	*next;
+	struct dnet_conv_stat_hist	hist[DNET_CONV_STAT_MAX];
+};
+
+static struct dnet_conv_stat_state {
+	pthread_mutex_t			lock;
+	char				*path;
+	struct dnet_conv_stat_thread	*threads;
+	struct dnet_conv_stat_hist	merged[DNET_CONV_STAT_MAX];
+} dnet_conv_stat_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *dnet_conv_stat_names[DNET_CONV_STAT_MAX] = {
+	"source_read", "meta_read", "meta_build", "hash", "meta_write", "log",
+};
+
+static __thread struct dnet_conv_stat_thread *dnet_conv_stat_tstat;
+
+int dnet_conv_stat_init(const char *path)
+{
+	struct dnet_conv_stat_state *st = &dnet_conv_stat_state;
+
+	st->path = strdup(path);
+	if (!st->path)
+		return -ENOMEM;
+
+	dnet_conv_stat_enabled = 1;
+	return 0;
+}
+
+uint64_t dnet_conv_stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int dnet_conv_stat_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < (1 << DNET_CONV_STAT_SUB_BITS))
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - DNET_CONV_STAT_SUB_BITS + 1) << DNET_CONV_STAT_SUB_BITS) +
+		((v >> (e - DNET_CONV_STAT_SUB_BITS)) & ((1 << DNET_CONV_STAT_SUB_BITS) - 1));
+}
+
+/* smallest value that falls into bucket @b */
+static uint64_t dnet_conv_stat_lower(int b)
+{
+	int group = b >> DNET_CONV_STAT_SUB_BITS;
+
+	if (!group)
+		return b;
+
+	return (uint64_t)((1 << DNET_CONV_STAT_SUB_BITS) + (b & ((1 << DNET_CONV_STAT_SUB_BITS) - 1))) << (group - 1);
+}
+
+static struct dnet_conv_stat_thread *dnet_conv_stat_get(void)
+{
+	struct dnet_conv_stat_state *st = &dnet_conv_stat_state;
+	struct dnet_conv_stat_thread *t;
+
+	t = calloc(1, sizeof(struct dnet_conv_stat_thread));
+	if (!t)
+		return NULL;
+
+	pthread_mutex_lock(&st->lock);
+	t->next = st->threads;
+	st->threads = t;
+	pthread_mutex_unlock(&st->lock);
+
+	dnet_conv_stat_tstat = t;
+	return t;
+}
+
+/*
+ * Only the owning thread updates its histograms, so counters are bumped
+ * with plain relaxed stores and dump may see them a record behind.
+ */
+void dnet_conv_stat_add(int phase, uint64_t start)
+{
+	struct dnet_conv_stat_thread *t = dnet_conv_stat_tstat;
+	struct dnet_conv_stat_hist *h;
+	uint64_t v = dnet_conv_stat_now() - start;
+	int b;
+
+	if (!t) {
+		t = dnet_conv_stat_get();
+		if (!t)
+			return;
+	}
+
+	h = &t->hist[phase];
+	b = dnet_conv_stat_bucket(v);
+
+	__atomic_store_n(&h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* upper bound of the bucket holding @q quantile of @count values */
+static uint64_t dnet_conv_stat_quantile(struct dnet_conv_stat_hist *h, uint64_t count, double q)
+{
+	uint64_t target = q * count, seen = 0, upper;
+	int b;
+
+	if (target < 1)
+		target = 1;
+
+	for (b = 0; b < DNET_CONV_STAT_BUCKETS; ++b) {
+		seen += h->bucket[b];
+		if (seen >= target)
+			break;
+	}
+
+	if (b >= DNET_CONV_STAT_BUCKETS - 1)
+		return h->max;
+
+	upper = dnet_conv_stat_lower(b + 1) - 1;
+	return upper < h->max ? upper : h->max;
+}
+
+/*
+ * Merges histograms of all threads and rewrites stats file through
+ * a temporary one, so readers never see partial JSON.
+ */
+void dnet_conv_stat_dump(void)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	static const char *quantile_names[] = {"p50", "p90", "p99", "p999"};
+	struct dnet_conv_stat_state *st = &dnet_conv_stat_state;
+	struct dnet_conv_stat_thread *t;
+	struct dnet_conv_stat_hist *h, *m;
+	char tmp[PATH_MAX];
+	uint64_t count, max;
+	int thread_num = 0, p, b, q, first, err;
+	FILE *f;
+
+	if (!st->path)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+
+	memset(st->merged, 0, sizeof(st->merged));
+	for (t = st->threads; t; t = t->next) {
+		thread_num++;
+
+		for (p = 0; p < DNET_CONV_STAT_MAX; ++p) {
+			h = &t->hist[p];
+			m = &st->merged[p];
+
+			m->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+			max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+			if (max > m->max)
+				m->max = max;
+
+			for (b = 0; b < DNET_CONV_STAT_BUCKETS; ++b)
+				m->bucket[b] += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+		}
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", st->path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to open stats file: %d.\n", tmp, err);
+		goto err_out_unlock;
+	}
+
+	fprintf(f, "{\n  \"time\": %ld,\n  \"threads\": %d,\n  \"phases\": {", (long)time(NULL), thread_num);
+
+	for (p = 0; p < DNET_CONV_STAT_MAX; ++p) {
+		m = &st->merged[p];
+
+		count = 0;
+		for (b = 0; b < DNET_CONV_STAT_BUCKETS; ++b)
+			count += m->bucket[b];
+
+		fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"mean_ns\": %llu, \"max_ns\": %llu",
+				p ? "," : "", dnet_conv_stat_names[p], (unsigned long long)count,
+				(unsigned long long)m->sum, (unsigned long long)(count ? m->sum / count : 0),
+				(unsigned long long)m->max);
+
+		for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++q)
+			fprintf(f, ", \"%s_ns\": %llu", quantile_names[q],
+					(unsigned long long)(count ? dnet_conv_stat_quantile(m, count, quantiles[q]) : 0));
+
+		/* non-empty buckets as [lower bound, count] pairs */
+		fprintf(f, ", \"histogram\": [");
+		for (b = 0, first = 1; b < DNET_CONV_STAT_BUCKETS; ++b) {
+			if (!m->bucket[b])
+				continue;
+
+			fprintf(f, "%s[%llu, %llu]", first ? "" : ", ",
+					(unsigned long long)dnet_conv_stat_lower(b), (unsigned long long)m->bucket[b]);
+			first = 0;
+		}
+		fprintf(f, "]}");
+	}
+
+	fprintf(f, "\n  }\n}\n");
+
+	if (fclose(f)) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to write stats file: %d.\n", tmp, err);
+		goto err_out_unlock;
+	}
+
+	if (rename(tmp, st->path)) {
+		err = -errno;
+		fprintf(stderr, "%s: failed to rename stats file: %d.\n", st->path, err);
+	}
+
+err_out_unlock:
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void dnet_conv_stat_cleanup(void)
+{
+	struct dnet_conv_stat_state *st = &dnet_conv_stat_state;
+	struct dnet_conv_stat_thread *t, *next;
+
+	pthread_mutex_lock(&st->lock);
+	for (t = st->threads; t; t = next) {
+		next = t->next;
+		free(t);
+	}
+	st->threads = NULL;
+
+	free(st->path);
+	st->path = NULL;
+	dnet_conv_stat_enabled = 0;
+	pthread_mutex_unlock(&st->lock);
+
+	dnet_conv_stat_tstat = NULL;
+}
+
+int dnet_conv_log_level = DNET_CONV_LOG_KEY;
+
+/*
+ * Every thread formats its messages into own buffer, background thread
+ * periodically writes all buffers out and prints progress line.
+ * Writer thread itself only touches stdout when its buffer is full.
+ */
+struct dnet_conv_log_buf {
+	struct dnet_conv_log_buf	*next;
+	pthread_mutex_t			lock;
+	int				used;
+	char				data[DNET_CONV_LOG_BUF_SIZE];
+};
+
+static struct dnet_conv_log_state {
+	pthread_mutex_t			lock;
+	pthread_mutex_t			out_lock;
+	pthread_cond_t			wait;
+	pthread_t			tid;
+	int				started;
+	int				need_exit;
+
+	struct dnet_conv_log_buf	*bufs;
+
+	int				interval;
+	uint64_t			(* processed)(void *priv);
+	void				*priv;
+	uint64_t			total;
+	struct timeval			start;
+	struct timeval			last;
+	uint64_t			last_processed;
+} dnet_conv_log_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.out_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wait = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct dnet_conv_log_buf *dnet_conv_log_tbuf;
+
+static struct dnet_conv_log_buf *dnet_conv_log_get_buf(void)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+	struct dnet_conv_log_buf *b = dnet_conv_log_tbuf;
+
+	if (b)
+		return b;
+
+	b = malloc(sizeof(struct dnet_conv_log_buf));
+	if (!b)
+		return NULL;
+
+	pthread_mutex_init(&b->lock, NULL);
+	b->used = 0;
+
+	pthread_mutex_lock(&st->lock);
+	b->next = st->bufs;
+	st->bufs = b;
+	pthread_mutex_unlock(&st->lock);
+
+	dnet_conv_log_tbuf = b;
+	return b;
+}
+
+/* must be called with @b->lock held */
+static void dnet_conv_log_flush_buf(struct dnet_conv_log_buf *b)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+
+	if (!b->used)
+		return;
+
+	pthread_mutex_lock(&st->out_lock);
+	fwrite(b->data, 1, b->used, stdout);
+	pthread_mutex_unlock(&st->out_lock);
+
+	b->used = 0;
+}
+
+static void dnet_conv_log_flush_all(void)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+	struct dnet_conv_log_buf *b;
+
+	pthread_mutex_lock(&st->lock);
+	for (b = st->bufs; b; b = b->next) {
+		pthread_mutex_lock(&b->lock);
+		dnet_conv_log_flush_buf(b);
+		pthread_mutex_unlock(&b->lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	pthread_mutex_lock(&st->out_lock);
+	fflush(stdout);
+	pthread_mutex_unlock(&st->out_lock);
+}
+
+void dnet_conv_log_raw(int level __attribute((unused)), const char *fmt, ...)
+{
+	struct dnet_conv_log_buf *b;
+	uint64_t start = dnet_conv_stat_start();
+	va_list args;
+	int len;
+
+	b = dnet_conv_log_get_buf();
+	if (!b) {
+		va_start(args, fmt);
+		vfprintf(stdout, fmt, args);
+		va_end(args);
+		dnet_conv_stat_end(DNET_CONV_STAT_LOG, start);
+		return;
+	}
+
+	pthread_mutex_lock(&b->lock);
+
+	va_start(args, fmt);
+	len = vsnprintf(b->data + b->used, DNET_CONV_LOG_BUF_SIZE - b->used, fmt, args);
+	va_end(args);
+
+	if (len >= DNET_CONV_LOG_BUF_SIZE - b->used) {
+		dnet_conv_log_flush_buf(b);
+
+		va_start(args, fmt);
+		len = vsnprintf(b->data, DNET_CONV_LOG_BUF_SIZE, fmt, args);
+		va_end(args);
+
+		if (len >= DNET_CONV_LOG_BUF_SIZE)
+			len = DNET_CONV_LOG_BUF_SIZE - 1;
+	}
+
+	if (len > 0)
+		b->used += len;
+
+	pthread_mutex_unlock(&b->lock);
+	dnet_conv_stat_end(DNET_CONV_STAT_LOG, start);
+}
+
+static void dnet_conv_progress_print(struct dnet_conv_log_state *st)
+{
+	struct timeval tv;
+	struct tm tm;
+	char tstr[64];
+	uint64_t processed;
+	double elapsed, rate, avg;
+	long eta;
+
+	if (!st->processed)
+		return;
+
+	processed = st->processed(st->priv);
+	gettimeofday(&tv, NULL);
+
+	elapsed = (tv.tv_sec - st->last.tv_sec) + (tv.tv_usec - st->last.tv_usec) / 1000000.0;
+	rate = elapsed > 0 ? (processed - st->last_processed) / elapsed : 0;
+
+	elapsed = (tv.tv_sec - st->start.tv_sec) + (tv.tv_usec - st->start.tv_usec) / 1000000.0;
+	avg = elapsed > 0 ? processed / elapsed : 0;
+
+	st->last = tv;
+	st->last_processed = processed;
+
+	localtime_r((time_t *)&tv.tv_sec, &tm);
+	strftime(tstr, sizeof(tstr), "%F %R:%S %Z", &tm);
+
+	if (st->total && avg > 0 && processed < st->total) {
+		eta = (st->total - processed) / avg;
+		fprintf(stderr, "%s: %llu/%llu records processed, %.0f records/s, ETA %ld:%02ld:%02ld\n",
+				tstr, (unsigned long long)processed, (unsigned long long)st->total, rate,
+				eta / 3600, (eta / 60) % 60, eta % 60);
+	} else {
+		fprintf(stderr, "%s: %llu/%llu records processed, %.0f records/s\n",
+				tstr, (unsigned long long)processed, (unsigned long long)st->total, rate);
+	}
+}
+
+static void *dnet_conv_log_process(void *priv)
+{
+	struct dnet_conv_log_state *st = priv;
+	struct timespec ts;
+	int ticks = 0;
+
+	pthread_mutex_lock(&st->lock);
+	while (!st->need_exit) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += DNET_CONV_LOG_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&st->wait, &st->lock, &ts);
+		pthread_mutex_unlock(&st->lock);
+
+		dnet_conv_log_flush_all();
+
+		pthread_mutex_lock(&st->lock);
+
+		ticks += DNET_CONV_LOG_FLUSH_INTERVAL;
+		if (st->interval && ticks >= st->interval) {
+			if (dnet_conv_log_level >= DNET_CONV_LOG_SUMMARY)
+				dnet_conv_progress_print(st);
+			ticks = 0;
+
+			pthread_mutex_unlock(&st->lock);
+			dnet_conv_stat_dump();
+			pthread_mutex_lock(&st->lock);
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	return NULL;
+}
+
+int dnet_conv_log_init(int level, int progress_interval)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+	int err;
+
+	dnet_conv_log_level = level;
+	st->interval = progress_interval;
+
+	err = -pthread_create(&st->tid, NULL, dnet_conv_log_process, st);
+	if (err)
+		return err;
+
+	st->started = 1;
+	return 0;
+}
+
+/*
+ * Progress line is printed every progress interval with records/s for the
+ * last interval and ETA based on average rate. @total may be 0 if unknown.
+ */
+void dnet_conv_progress_start(uint64_t (* processed)(void *priv), void *priv, uint64_t total)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+
+	pthread_mutex_lock(&st->lock);
+	st->priv = priv;
+	st->total = total;
+	st->last_processed = 0;
+	gettimeofday(&st->start, NULL);
+	st->last = st->start;
+	st->processed = processed;
+	pthread_mutex_unlock(&st->lock);
+}
+
+uint64_t dnet_meta_write_rate = DNET_META_WRITE_RATE;
+uint64_t dnet_meta_write_bandwidth = DNET_META_WRITE_BANDWIDTH;
+
+int dnet_parse_write_rate(const char *value)
+{
+	unsigned long long rate, bandwidth = dnet_meta_write_bandwidth;
+	char tail;
+	int num;
+
+	num = sscanf(value, "%llu:%llu%c", &rate, &bandwidth, &tail);
+	if ((num != 1 && num != 2) || !rate || !bandwidth) {
+		fprintf(stderr, "invalid write rate '%s', expected records/s[:MB/s]\n", value);
+		return -EINVAL;
+	}
+
+	dnet_meta_write_rate = rate;
+	dnet_meta_write_bandwidth = bandwidth;
+	return 0;
+}
+
+/*
+ * Dry run summary: what the real pass would do and how long it would take
+ * to go over @total records (0 if unknown). Reading is extrapolated from
+ * the rate seen so far, writes of the counted records and bytes are added
+ * at dnet_meta_write_rate and dnet_meta_write_bandwidth.
+ */
+void dnet_meta_writer_report(struct dnet_meta_writer *w, uint64_t processed, uint64_t created, uint64_t total)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+	uint64_t queued = __atomic_load_n(&w->queued, __ATOMIC_ACQUIRE);
+	struct timeval now;
+	double elapsed, scale, read_time, write_time;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - st->start.tv_sec) + (now.tv_usec - st->start.tv_usec) / 1000000.0;
+	if (elapsed < 0.001)
+		elapsed = 0.001;
+
+	if (created > queued)
+		created = queued;
+
+	fprintf(stderr, "Dry run: processed %llu records in %.1f s (%.0f records/s)\n"
+			"  to create: %llu, to patch: %llu, unchanged: %llu\n"
+			"  to write: %llu records, %llu bytes\n",
+			(unsigned long long)processed, elapsed, processed / elapsed,
+			(unsigned long long)created, (unsigned long long)(queued - created),
+			(unsigned long long)(processed > queued ? processed - queued : 0),
+			(unsigned long long)queued, (unsigned long long)w->queued_bytes);
+
+	if (total && processed) {
+		scale = (double)total / processed;
+		read_time = elapsed * scale;
+		write_time = queued * scale / dnet_meta_write_rate +
+			w->queued_bytes * scale / (dnet_meta_write_bandwidth * 1024.0 * 1024.0);
+
+		fprintf(stderr, "  estimated time for %llu records: %.0f s "
+				"(read %.0f s, write %.0f s at %llu records/s, %llu MB/s)\n",
+				(unsigned long long)total, read_time + write_time, read_time, write_time,
+				(unsigned long long)dnet_meta_write_rate,
+				(unsigned long long)dnet_meta_write_bandwidth);
+	}
+}
+
+void dnet_conv_progress_stop(void)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+
+	pthread_mutex_lock(&st->lock);
+	st->processed = NULL;
+	pthread_mutex_unlock(&st->lock);
+}
+
+void dnet_conv_log_exit(void)
+{
+	struct dnet_conv_log_state *st = &dnet_conv_log_state;
+	struct dnet_conv_log_buf *b, *next;
+
+	if (st->started) {
+		pthread_mutex_lock(&st->lock);
+		st->need_exit = 1;
+		pthread_cond_broadcast(&st->wait);
+		pthread_mutex_unlock(&st->lock);
+
+		pthread_join(st->tid, NULL);
+		st->started = 0;
+	}
+
+	dnet_conv_log_flush_all();
+
+	dnet_conv_stat_dump();
+	dnet_conv_stat_cleanup();
+
+	pthread_mutex_lock(&st->lock);
+	for (b = st->bufs; b; b = next) {
+		next = b->next;
+		pthread_mutex_destroy(&b->lock);
+		free(b);
+	}
+	st->bufs = NULL;
+	pthread_mutex_unlock(&st->lock);
+
+	dnet_conv_log_tbuf = NULL;
+}
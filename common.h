@@ -17,6 +17,8 @@
 #ifndef __COMMON_H
 #define __COMMON_H
 
+#include <pthread.h>
+#include <stdio.h>
 #include <time.h>
 
 #include <elliptics/packet.h>
@@ -38,17 +40,355 @@ struct dnet_meta_create_control {
 
 	uint64_t			update_flags;
 	struct timespec			ts;
+	/* update entry time when it differs from @ts, unset means @ts */
+	struct timespec			update_ts;
 
 	uint8_t				checksum[DNET_CSUM_SIZE];
 };
 
+/*
+ * Converter logging: messages are formatted into per-thread buffers and
+ * written out by background thread, which also prints periodic progress.
+ * Level check happens before arguments are evaluated.
+ */
+enum dnet_conv_log_levels {
+	DNET_CONV_LOG_ERROR = 0,		/* errors only */
+	DNET_CONV_LOG_SUMMARY,			/* errors, progress and totals */
+	DNET_CONV_LOG_KEY,			/* everything including per-key lines */
+};
+
+#define DNET_CONV_LOG_BUF_SIZE		(64 * 1024)
+#define DNET_CONV_LOG_FLUSH_INTERVAL	1
+#define DNET_CONV_PROGRESS_INTERVAL	10
+
+extern int dnet_conv_log_level;
+
+#define dnet_conv_log(level, fmt, a...) \
+	do { \
+		if ((level) <= dnet_conv_log_level) \
+			dnet_conv_log_raw((level), fmt, ##a); \
+	} while (0)
+
+void dnet_conv_log_raw(int level, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
+int dnet_conv_log_init(int level, int progress_interval);
+void dnet_conv_log_exit(void);
+void dnet_conv_progress_start(uint64_t (* processed)(void *priv), void *priv, uint64_t total);
+void dnet_conv_progress_stop(void);
+
+/*
+ * Per-phase latency statistics. Every thread keeps its own log-linear
+ * histograms (8 sub-buckets per power of two, about 12% precision), which
+ * are merged and dumped as JSON into the stats file every progress interval
+ * and at logger exit. Timers are a single branch when stats are disabled.
+ * Phases may nest: logging and history reads done while building meta
+ * are also included in the enclosing phase.
+ */
+enum dnet_conv_stat_phases {
+	DNET_CONV_STAT_SOURCE_READ = 0,		/* KC record, history or input object lookup */
+	DNET_CONV_STAT_META_READ,		/* existing meta record lookup */
+	DNET_CONV_STAT_META_BUILD,		/* parsing and building meta container */
+	DNET_CONV_STAT_HASH,			/* object checksum */
+	DNET_CONV_STAT_META_WRITE,		/* eblob or bulk blob write */
+	DNET_CONV_STAT_LOG,			/* message formatting */
+	DNET_CONV_STAT_MAX,
+};
+
+#define DNET_CONV_STAT_SUB_BITS		3
+#define DNET_CONV_STAT_BUCKETS		(64 << DNET_CONV_STAT_SUB_BITS)
+
+extern int dnet_conv_stat_enabled;
+
+#define dnet_conv_stat_start() \
+	(dnet_conv_stat_enabled ? dnet_conv_stat_now() : 0)
+
+#define dnet_conv_stat_end(phase, start) \
+	do { \
+		if (start) \
+			dnet_conv_stat_add((phase), (start)); \
+	} while (0)
+
+int dnet_conv_stat_init(const char *path);
+uint64_t dnet_conv_stat_now(void);
+void dnet_conv_stat_add(int phase, uint64_t start);
+void dnet_conv_stat_dump(void);
+
+/*
+ * Meta containers are little-endian on disk. WORDS_BIGENDIAN is set by
+ * configure, elliptics conversion helpers and whole-container conversion
+ * below compile to nothing on little-endian hosts.
+ */
+#ifdef WORDS_BIGENDIAN
+void dnet_meta_container_to_wire(void *data, unsigned int size);
+#else
+#define dnet_meta_container_to_wire(data, size)	do { } while (0)
+#endif
+
+int dnet_create_meta_size(struct dnet_meta_create_control *ctl);
+int dnet_create_write_meta_buf(struct dnet_meta_create_control *ctl, void *buf, int buf_size);
 int dnet_create_write_meta(struct dnet_meta_create_control *ctl, void **data);
-struct dnet_meta * dnet_meta_search_cust(struct dnet_meta_container *mc, uint32_t type);
+
+/*
+ * Per-thread scratch buffer to build meta containers in place.
+ * Default size covers usual layout with object name and a few groups.
+ */
+#define DNET_META_ARENA_SIZE		4096
+
+struct dnet_meta_arena {
+	void				*data;
+	int				size;
+};
+
+void *dnet_meta_arena_reserve(struct dnet_meta_arena *a, int size);
+void dnet_meta_arena_destroy(struct dnet_meta_arena *a);
+
+/*
+ * Index of meta container entries by type built in a single walk. Entries
+ * are not copied: @entry points into the container and entry data stays in
+ * wire byte order, only entry sizes are kept in host order. If a type
+ * occurs more than once, the first entry is used unless DNET_META_VIEW_LAST
+ * is given.
+ */
+struct dnet_meta_view {
+	struct dnet_meta		*entry[__DNET_META_MAX];
+	uint32_t			size[__DNET_META_MAX];
+};
+
+#define DNET_META_VIEW_LAST		(1<<0)
+
+int dnet_meta_view_init(struct dnet_meta_view *v, void *data, unsigned int size, int flags);
+struct dnet_meta *dnet_meta_view_find(const struct dnet_meta_view *v, uint32_t type);
+char *dnet_meta_view_parent(const struct dnet_meta_view *v, int *len);
+int *dnet_meta_view_groups(const struct dnet_meta_view *v, int *group_num);
+struct dnet_meta_checksum *dnet_meta_view_checksum(const struct dnet_meta_view *v);
+struct dnet_meta_update *dnet_meta_view_update(const struct dnet_meta_view *v);
+
 void dnet_common_log(void *priv __attribute((unused)), uint32_t mask, const char *msg);
 int dnet_parse_groups(char *value, int **groupsp);
 
+/*
+ * Key space is split into @num equal ranges by leading 8 bytes of the key,
+ * process handles only keys from range @index. Zeroed shard matches all keys.
+ */
+struct dnet_shard {
+	unsigned int			index;
+	unsigned int			num;
+};
+
+int dnet_parse_shard(const char *value, struct dnet_shard *shard);
+int dnet_shard_match(const struct dnet_shard *shard, const void *key, size_t size);
+/* splits range of @shard into @num equal slots, returns slot of @key */
+int dnet_shard_slot(const struct dnet_shard *shard, const void *key, size_t size, int num);
+
+/*
+ * Bounded blocking FIFO used to hand records between converter threads.
+ */
+struct dnet_job_queue {
+	pthread_mutex_t			lock;
+	pthread_cond_t			wait;
+	pthread_cond_t			room;
+
+	void				**ring;
+	int				size;
+	int				head;
+	int				num;
+	int				closed;
+};
+
+int dnet_job_queue_init(struct dnet_job_queue *q, int size);
+void dnet_job_queue_destroy(struct dnet_job_queue *q);
+int dnet_job_queue_push(struct dnet_job_queue *q, void *job);
+void *dnet_job_queue_pop(struct dnet_job_queue *q);
+int dnet_job_queue_pop_batch(struct dnet_job_queue *q, void **jobs, int max);
+void dnet_job_queue_close(struct dnet_job_queue *q);
+
+/*
+ * Write-behind stage: converters queue ready meta containers and single
+ * writer thread drains them into eblob in batches.
+ */
+#define DNET_META_WRITER_QUEUE_SIZE	4096
+#define DNET_META_WRITER_BATCH		256
+
+/*
+ * Sequential writer of a fresh eblob used for bulk load.
+ */
+#define DNET_BULK_BUF_SIZE		(8 * 1024 * 1024)
+#define DNET_BULK_BLOB_SIZE		(50ULL * 1024 * 1024 * 1024)
+#define DNET_BULK_RECORDS_IN_BLOB	50000000ULL
+
+struct dnet_bulk_blob {
+	char				*path;
+	int				num;
+
+	FILE				*data;
+	FILE				*index;
+	char				*data_buf;
+	char				*index_buf;
+
+	uint64_t			offset;
+	uint64_t			records;
+
+	uint64_t			blob_size;
+	uint64_t			records_in_blob;
+
+	int				failed;		/* first write error, blob is not usable after it */
+};
+
+int dnet_bulk_blob_init(struct dnet_bulk_blob *bb, const char *path);
+int dnet_bulk_blob_cleanup(struct dnet_bulk_blob *bb);
+int dnet_bulk_blob_write(struct dnet_bulk_blob *bb, struct dnet_raw_id *id, void *data, unsigned int size);
+
+/*
+ * Writer started without backend and bulk blob is a dry run: records are
+ * only counted, nothing is written.
+ */
+struct dnet_meta_writer {
+	struct eblob_backend		*backend;
+	struct dnet_bulk_blob		*bulk;
+	int				dry_run;
+	struct dnet_job_queue		queue;
+	struct dnet_job_queue		free;
+	pthread_t			tid;
+
+	uint64_t			queued;
+	uint64_t			queued_bytes;
+	uint64_t			written;
+	uint64_t			errors;
+
+	int				failed;		/* bulk blob write error, no more records are accepted */
+};
+
+int dnet_meta_writer_start(struct dnet_meta_writer *w, struct eblob_backend *b,
+		struct dnet_bulk_blob *bulk, int queue_size);
+int dnet_meta_writer_queue(struct dnet_meta_writer *w, struct dnet_raw_id *id, void *data, unsigned int size);
+void dnet_meta_writer_stop(struct dnet_meta_writer *w);
+void dnet_meta_writer_report(struct dnet_meta_writer *w, uint64_t processed, uint64_t created, uint64_t total);
+
+/*
+ * Write cost dry run adds to its own time: eblob meta records per second
+ * and megabytes per second, changed with dnet_parse_write_rate("R[:MB]").
+ */
+#define DNET_META_WRITE_RATE		20000
+#define DNET_META_WRITE_BANDWIDTH	64
+
+extern uint64_t dnet_meta_write_rate;
+extern uint64_t dnet_meta_write_bandwidth;
+int dnet_parse_write_rate(const char *value);
+
+/*
+ * Scans a block of on-disk eblob index entries and stores positions of
+ * records without BLOB_DISK_CTL_REMOVE into @live, returns their number.
+ * Blocks are limited to DNET_EBLOB_SCAN_BLOCK entries.
+ */
+#define DNET_EBLOB_SCAN_BLOCK		1024
+
+int dnet_eblob_scan_live(const void *index, int num, uint16_t *live);
+
+/*
+ * Sorted in-memory fingerprint index of eblob records: leading 8 bytes of
+ * the key in big-endian (numeric order equals key byte order) and record
+ * location. Full key is verified when the record is read.
+ */
+#define DNET_META_INDEX_LOC_SHIFT	48
+#define DNET_META_INDEX_POS_MASK	((1ULL << DNET_META_INDEX_LOC_SHIFT) - 1)
+
+struct dnet_meta_index_entry {
+	uint64_t			prefix;
+	uint64_t			loc;		/* blob number << 48 | record position */
+};
+
+struct dnet_meta_index {
+	struct dnet_meta_index_entry	*ent;
+	uint64_t			num;
+
+	int				*fds;		/* data files to read records from */
+	int				blob_num;
+};
+
+uint64_t dnet_meta_index_prefix(const unsigned char *id);
+int dnet_meta_index_build(struct dnet_meta_index *idx, const char *path);
+void dnet_meta_index_destroy(struct dnet_meta_index *idx);
+uint64_t dnet_meta_index_lower_bound(struct dnet_meta_index *idx, uint64_t prefix);
+int dnet_meta_index_read(struct dnet_meta_index *idx, uint64_t loc, const unsigned char *id,
+		struct dnet_meta_arena *arena);
+int dnet_meta_index_exists(struct dnet_meta_index *idx, const unsigned char *id);
+int dnet_meta_index_lookup(struct dnet_meta_index *idx, const unsigned char *id, struct dnet_meta_arena *arena);
+
+/*
+ * Resume support: iteration position is saved into a sidecar file once
+ * everything before it has reached the disk. Taking a checkpoint never
+ * stalls the pipeline, pending checkpoint is promoted by periodic
+ * dnet_checkpoint_poll() calls as each stage drains past it.
+ */
+#define DNET_CHECKPOINT_INTERVAL	5
+#define DNET_CHECKPOINT_BATCH		1024
+#define DNET_CHECKPOINT_POS_SIZE	256
+#define DNET_CHECKPOINT_MAGIC		0x31504b4354454e44ULL	/* "DNETCKP1" */
+
+struct dnet_checkpoint_data {
+	uint64_t			magic;
+	uint64_t			processed;
+	uint32_t			pos_size;
+	char				pos[DNET_CHECKPOINT_POS_SIZE];
+};
+
+enum dnet_checkpoint_states {
+	DNET_CHECKPOINT_IDLE = 0,
+	DNET_CHECKPOINT_WORKERS,		/* workers have not processed records before position yet */
+	DNET_CHECKPOINT_WRITER,			/* writer has not stored everything workers queued */
+	DNET_CHECKPOINT_SYNC,			/* eblob has not synced written data yet */
+};
+
+struct dnet_checkpoint {
+	char				*path;
+	struct dnet_meta_writer		*writer;
+	int				sync_delay;
+
+	int				state;
+	time_t				stamp;
+	uint64_t			writer_mark;
+	struct dnet_checkpoint_data	data;
+};
+
+int dnet_checkpoint_init(struct dnet_checkpoint *c, const char *path, struct dnet_meta_writer *w, int sync_delay);
+void dnet_checkpoint_cleanup(struct dnet_checkpoint *c, int finished);
+int dnet_checkpoint_load(const char *path, struct dnet_checkpoint_data *d);
+int dnet_checkpoint_need(struct dnet_checkpoint *c);
+void dnet_checkpoint_take(struct dnet_checkpoint *c, const void *pos, unsigned int size, uint64_t processed);
+int dnet_checkpoint_poll(struct dnet_checkpoint *c, int workers_done);
+
 #ifdef __cplusplus
 }
+
+/*
+ * Typed access to meta container entries, get<T>() returns NULL if entry
+ * is missing or too small to hold T.
+ */
+class dnet_meta_view_ref {
+	public:
+		dnet_meta_view_ref(void *data, unsigned int size) {
+			valid_ = !dnet_meta_view_init(&view_, data, size, 0);
+		}
+
+		bool valid(void) const {
+			return valid_;
+		}
+
+		template <typename T>
+		T *get(uint32_t type, unsigned int *num = NULL) const {
+			struct dnet_meta *m = dnet_meta_view_find(&view_, type);
+
+			if (!m || view_.size[type] < sizeof(T))
+				return NULL;
+
+			if (num)
+				*num = view_.size[type] / sizeof(T);
+			return (T *)m->data;
+		}
+
+	private:
+		struct dnet_meta_view view_;
+		bool valid_;
+};
 #endif
 
 #endif /* __COMMON_H */
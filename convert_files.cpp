@@ -1,25 +1,46 @@
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 namespace fs = boost::filesystem;
 
+#include <openssl/evp.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
 #include <eblob/blob.h>
 
 #include "common.h"
@@ -32,14 +53,176 @@ class processor_key {
 		uint64_t offset;
 		uint64_t size;
 		std::string id;
-		boost::shared_ptr<boost::iostreams::mapped_file> file;
+		uint64_t seq;
+		uint64_t file_size;	/* object data is only read by io engine when checksumming */
 };
 
 class generic_processor {
 	public:
-		virtual processor_key next(void) = 0;
+		generic_processor(const struct dnet_shard &shard) : shard_(shard), active_(&generic_processor::keep_active) {}
+
+		virtual ~generic_processor() {
+			for (std::vector<uint64_t *>::iterator it = actives_.begin(); it != actives_.end(); ++it)
+				delete *it;
+		}
+
+		/*
+		 * Called by all workers concurrently without external locking.
+		 * Returns false when the whole input has been handed out.
+		 */
+		virtual bool next(processor_key &key) = 0;
+
+		/* number of records to process if known in advance, 0 otherwise */
+		virtual uint64_t total(void) {
+			return 0;
+		}
+
+		/*
+		 * Resume position: every record before it has been completely
+		 * processed, @processed is set to number of such records.
+		 * Returns UINT64_MAX if there is nothing left to resume.
+		 */
+		virtual uint64_t position(uint64_t *processed) = 0;
+
+		/* called by worker that stops taking records, possibly after a failure */
+		virtual void release(void) {
+		}
+
+		/* true if part of the input could not be read and was not handed out */
+		virtual bool failed(void) {
+			return false;
+		}
+
+	protected:
+		struct dnet_shard shard_;
+
+		bool in_shard(const std::string &id) {
+			return dnet_shard_match(&shard_, id.data(), id.size());
+		}
+
+		/*
+		 * Per-thread lower bound of the position worker is busy with.
+		 * Workers publish it before claiming next record, so minimum over
+		 * all threads never runs ahead of unfinished work.
+		 */
+		uint64_t *active(uint64_t initial) {
+			uint64_t *a = active_.get();
+
+			if (!a) {
+				a = new uint64_t(initial);
+
+				boost::mutex::scoped_lock guard(active_lock_);
+				actives_.push_back(a);
+				active_.reset(a);
+			}
+
+			return a;
+		}
+
+		uint64_t min_active(uint64_t low) {
+			boost::mutex::scoped_lock guard(active_lock_);
+
+			for (std::vector<uint64_t *>::iterator it = actives_.begin(); it != actives_.end(); ++it)
+				low = std::min(low, __atomic_load_n(*it, __ATOMIC_SEQ_CST));
+
+			return low;
+		}
+
+	private:
+		boost::mutex active_lock_;
+		std::vector<uint64_t *> actives_;
+		boost::thread_specific_ptr<uint64_t> active_;
+
+		/* slots outlive worker threads, they are freed with processor */
+		static void keep_active(uint64_t *) {}
 };
 
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue (Vyukov's algorithm).
+ * Size must be a power of two.
+ */
+template <typename T>
+class mpmc_queue {
+	public:
+		mpmc_queue(size_t size) : mask_(size - 1), cells_(new cell[size]), enqueue_(0), dequeue_(0) {
+			for (size_t i = 0; i < size; ++i)
+				cells_[i].seq = i;
+		}
+
+		~mpmc_queue() {
+			delete [] cells_;
+		}
+
+		bool push(const T &data) {
+			size_t pos = __atomic_load_n(&enqueue_, __ATOMIC_RELAXED);
+			cell *c;
+
+			while (true) {
+				c = &cells_[pos & mask_];
+
+				intptr_t diff = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+				if (diff == 0) {
+					if (__atomic_compare_exchange_n(&enqueue_, &pos, pos + 1, true,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+						break;
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = __atomic_load_n(&enqueue_, __ATOMIC_RELAXED);
+				}
+			}
+
+			c->data = data;
+			__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		/* number of elements popped so far */
+		size_t head(void) {
+			return __atomic_load_n(&dequeue_, __ATOMIC_SEQ_CST);
+		}
+
+		bool pop(T &data) {
+			size_t pos = __atomic_load_n(&dequeue_, __ATOMIC_RELAXED);
+			cell *c;
+
+			while (true) {
+				c = &cells_[pos & mask_];
+
+				intptr_t diff = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+				if (diff == 0) {
+					if (__atomic_compare_exchange_n(&dequeue_, &pos, pos + 1, true,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+						break;
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = __atomic_load_n(&dequeue_, __ATOMIC_RELAXED);
+				}
+			}
+
+			data = c->data;
+			c->data = T();
+			__atomic_store_n(&c->seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+	private:
+		struct cell {
+			size_t seq;
+			T data;
+		};
+
+		size_t mask_;
+		cell *cells_;
+
+		/* producers and consumers live on different cache lines */
+		char pad0_[64];
+		size_t enqueue_;
+		char pad1_[64];
+		size_t dequeue_;
+		char pad2_[64];
+};
 
 struct timespec parse_time(std::string &datetime)
 {
@@ -61,119 +244,618 @@ struct timespec parse_time(std::string &datetime)
 	return datetime_dt;
 }
 
+/*
+ * All blob/index pairs are discovered up front and split into fixed chunks
+ * numbered across files, workers claim chunks by atomically bumping single
+ * cursor and then scan them on their own. There is no locking at all.
+ * Removed records are filtered out for the whole chunk at claim time.
+ *
+ * With several NUMA nodes every node gets its own list of files local to
+ * it and its own cursor, workers take chunks of their node first and steal
+ * from other lists once it is exhausted.
+ */
 class eblob_processor : public generic_processor {
 	public:
-		eblob_processor(const std::string &path) : path_(path), index_(0) {
-			open_index();
+		eblob_processor(const std::string &path, const struct dnet_shard &shard, uint64_t start = 0,
+				int nodes = 1) :
+				generic_processor(shard), path_(path), chunks_(0), lists_(std::max(nodes, 1)) {
+			struct stat st;
+
+			for (int i = 0; ; ++i) {
+				std::string filename = path_ + "." + boost::lexical_cast<std::string>(i) + ".index";
+
+				/* the first blob is mandatory, the rest is whatever exists */
+				if (i && stat(filename.c_str(), &st))
+					break;
+
+				open_index(i);
+			}
+
+			start_ = locate(start);
+
+			for (std::vector<index_file *>::iterator it = files_.begin(); it != files_.end(); ++it) {
+				index_file *f = *it;
+				int node = lists_.size() > 1 ? numa_node(f->path) : 0;
+
+				/* files on unknown nodes are spread evenly */
+				if (node < 0 || node >= (int)lists_.size())
+					node = f->num % lists_.size();
+
+				chunk_list &l = lists_[node];
+
+				l.files.push_back(f);
+				l.first.push_back(l.chunks);
+				if (f->first_chunk + f->chunks <= start_)
+					l.cursor = l.chunks + f->chunks;
+				else if (f->first_chunk < start_)
+					l.cursor = l.chunks + start_ - f->first_chunk;
+				l.chunks += f->chunks;
+			}
 		}
 
 		virtual ~eblob_processor() {
-			if (file_.is_open())
-				file_.close();
+			for (std::vector<index_file *>::iterator it = files_.begin(); it != files_.end(); ++it)
+				delete *it;
+		}
 
+		uint64_t total(void) {
+			uint64_t records = 0;
+
+			for (std::vector<index_file *>::iterator it = files_.begin(); it != files_.end(); ++it)
+				records += (*it)->size / sizeof(struct eblob_disk_control);
+
+			return records;
+		}
+
+		/* position is index file number in upper bits and offset in that index */
+		uint64_t position(uint64_t *processed) {
+			uint64_t low = chunks_;
+
+			for (std::vector<chunk_list>::iterator it = lists_.begin(); it != lists_.end(); ++it)
+				low = std::min(low, global(*it, __atomic_load_n(&it->cursor, __ATOMIC_SEQ_CST)));
+
+			low = min_active(low);
+
+			if (low >= chunks_)
+				return UINT64_MAX;
+
+			index_file *f = find(low);
+			uint64_t offset = (low - f->first_chunk) * chunk_size;
+
+			*processed = offset / sizeof(struct eblob_disk_control);
+			for (int i = 0; i < f->num; ++i)
+				*processed += files_[i]->size / sizeof(struct eblob_disk_control);
+
+			return ((uint64_t)f->num << pos_shift) | offset;
 		}
 
-		processor_key next(void) {
+		bool next(processor_key &key) {
 			struct eblob_disk_control dc;
-			processor_key key;
+			chunk *ch = chunk_.get();
 
-			while (true) {
-				if (pos_ >= file_.size()) {
-					open_index();
+			if (!ch) {
+				ch = new chunk();
+				ch->active = active(start_);
+				ch->node = current_node();
+				chunk_.reset(ch);
+			}
+
+			do {
+				while (ch->cur >= ch->live_num) {
+					if (!claim(ch))
+						return false;
 				}
 
-				memcpy(&dc, file_.const_data() + pos_, sizeof(dc));
+				memcpy(&dc, ch->file->index.const_data() + ch->pos +
+						ch->live[ch->cur++] * sizeof(dc), sizeof(dc));
+			} while (!dnet_shard_match(&shard_, dc.key.id, sizeof(dc.key.id)));
 
-				std::cout << "offset: " << dc.position << ", size: " << dc.data_size <<
-					", disk_size: " << dc.disk_size << std::endl;
+			eblob_convert_disk_control(&dc);
 
-				pos_ += sizeof(dc);
+			dnet_conv_log(DNET_CONV_LOG_KEY, "offset: %llu, size: %llu, disk_size: %llu\n",
+					(unsigned long long)dc.position, (unsigned long long)dc.data_size,
+					(unsigned long long)dc.disk_size);
 
-				if (!(dc.flags & BLOB_DISK_CTL_REMOVE)) {
-					key.id.assign((char *)dc.key.id, sizeof(dc.key.id));
-					key.path = path_ + "." + boost::lexical_cast<std::string>(index_ - 1);
-					key.offset = dc.position + sizeof(dc);
-					key.size = dc.data_size;
-					key.file = data_file_;
-					break;
-				}
-			}
-			return key;
+			key.id.assign((char *)dc.key.id, sizeof(dc.key.id));
+			key.path = ch->file->path;
+			key.offset = dc.position + sizeof(dc);
+			key.size = dc.data_size;
+			key.file_size = ch->file->data_size;
+			return true;
 		}
 
 	private:
+		static const uint64_t chunk_size = DNET_EBLOB_SCAN_BLOCK * sizeof(struct eblob_disk_control);
+		static const int pos_shift = 48;
+		static const uint64_t pos_mask = (1ULL << pos_shift) - 1;
+
+		struct index_file {
+			int num;
+			std::string path;
+			boost::iostreams::mapped_file index;
+			uint64_t data_size;
+			uint64_t size;
+			uint64_t first_chunk;
+			uint64_t chunks;
+		};
+
+		/* files of one node, chunks are numbered within the list */
+		struct chunk_list {
+			chunk_list() : chunks(0), cursor(0) {}
+
+			std::vector<index_file *> files;
+			std::vector<uint64_t> first;
+			uint64_t chunks;
+			uint64_t cursor;
+			char pad[64];
+		};
+
+		struct chunk {
+			chunk() : file(NULL), pos(0), cur(0), live_num(0), node(0), active(NULL) {}
+
+			index_file *file;
+			uint64_t pos;
+			int cur;
+			int live_num;
+			uint16_t live[DNET_EBLOB_SCAN_BLOCK];
+			int node;
+			uint64_t *active;
+		};
+
 		std::string path_;
-		int index_;
-		uint64_t pos_;
-		boost::iostreams::mapped_file file_;
-		boost::shared_ptr<boost::iostreams::mapped_file> data_file_;
+		std::vector<index_file *> files_;
+		uint64_t chunks_;
+		uint64_t start_;
+		std::vector<chunk_list> lists_;
+		boost::thread_specific_ptr<chunk> chunk_;
+
+		static bool chunk_less(uint64_t n, const index_file *f) {
+			return n < f->first_chunk;
+		}
+
+		/* file holding global chunk @n, empty files are skipped naturally */
+		index_file *find(uint64_t n) {
+			std::vector<index_file *>::iterator it =
+				std::upper_bound(files_.begin(), files_.end(), n, chunk_less);
+			return *(it - 1);
+		}
+
+		/* checkpoint position to global chunk number */
+		uint64_t locate(uint64_t pos) {
+			uint64_t num = pos >> pos_shift;
+
+			if (num >= files_.size())
+				return chunks_;
+
+			index_file *f = files_[num];
+			uint64_t n = f->first_chunk + (pos & pos_mask) / chunk_size;
+
+			return std::min(n, chunks_);
+		}
+
+		/* global number of list-local chunk @n */
+		uint64_t global(const chunk_list &l, uint64_t n) {
+			if (n >= l.chunks)
+				return chunks_;
+
+			size_t i = std::upper_bound(l.first.begin(), l.first.end(), n) - l.first.begin() - 1;
+			return l.files[i]->first_chunk + n - l.first[i];
+		}
+
+		bool claim(chunk *ch) {
+			uint64_t n = chunks_;
+
+			for (size_t i = 0; i < lists_.size() && n >= chunks_; ++i) {
+				chunk_list &l = lists_[(ch->node + i) % lists_.size()];
+
+				/* publish lower bound before taking a chunk, see position() */
+				__atomic_store_n(ch->active, global(l, __atomic_load_n(&l.cursor, __ATOMIC_SEQ_CST)),
+						__ATOMIC_SEQ_CST);
+
+				n = global(l, __atomic_fetch_add(&l.cursor, 1, __ATOMIC_SEQ_CST));
+			}
+
+			if (n >= chunks_) {
+				__atomic_store_n(ch->active, UINT64_MAX, __ATOMIC_SEQ_CST);
+				return false;
+			}
+
+			__atomic_store_n(ch->active, n, __ATOMIC_SEQ_CST);
 
-		void open_index() {
+			index_file *f = find(n);
+			ch->file = f;
+			ch->pos = (n - f->first_chunk) * chunk_size;
+			ch->cur = 0;
+			ch->live_num = dnet_eblob_scan_live(f->index.const_data() + ch->pos,
+					(std::min(ch->pos + chunk_size, f->size) - ch->pos) / sizeof(struct eblob_disk_control),
+					ch->live);
+			return true;
+		}
+
+		void open_index(int num) {
 			std::ostringstream filename;
-			struct eblob_disk_control *dc;
-			uint64_t index_pos;
+			index_file *f = new index_file();
+			struct stat st;
 
-			pos_ = 0;
+			try {
+				filename << path_ << "." << num;
+				f->path = filename.str();
+
+				if (stat(f->path.c_str(), &st))
+					throw std::runtime_error(f->path + ": " + strerror(errno));
+				f->data_size = st.st_size;
+
+				filename << ".index";
+				if (stat(filename.str().c_str(), &st))
+					throw std::runtime_error(filename.str() + ": " + strerror(errno));
+
+				/* freshly created blob has empty index which can not be mapped */
+				if (st.st_size)
+					f->index.open(filename.str(), std::ios_base::in | std::ios_base::binary);
+			} catch (...) {
+				delete f;
+				throw;
+			}
 
-			if (file_.is_open())
-				file_.close();
+			f->num = num;
+			f->size = st.st_size / sizeof(struct eblob_disk_control) * sizeof(struct eblob_disk_control);
+			f->first_chunk = chunks_;
+			f->chunks = (f->size + chunk_size - 1) / chunk_size;
+			files_.push_back(f);
 
-			filename << path_ << "." << index_;
-			data_file_.reset(new boost::iostreams::mapped_file(filename.str(), std::ios_base::in | std::ios_base::binary));
+			chunks_ += f->chunks;
+		}
 
-			filename << ".index";
-			file_.open(filename.str(), std::ios_base::in | std::ios_base::binary);
+		int current_node(void) {
+#ifdef HAVE_LIBNUMA
+			if (lists_.size() > 1) {
+				int node = numa_node_of_cpu(sched_getcpu());
+				if (node >= 0)
+					return node % lists_.size();
+			}
+#endif
+			return 0;
+		}
 
-			++index_;
+		/*
+		 * Node of the device blob lives on, taken from sysfs entry of the
+		 * block device or, for partitions, of its parent. -1 if unknown.
+		 */
+		static int numa_node(const std::string &path) {
+			static const char *suffixes[] = {"/device/numa_node", "/device/device/numa_node",
+				"/../device/numa_node", "/../device/device/numa_node"};
+			struct stat st;
+			int node = -1;
+
+			if (stat(path.c_str(), &st))
+				return -1;
+
+			for (size_t i = 0; i < ARRAY_SIZE(suffixes) && node < 0; ++i) {
+				std::ostringstream name;
+				name << "/sys/dev/block/" << major(st.st_dev) << ":" << minor(st.st_dev) << suffixes[i];
+
+				std::ifstream in(name.str().c_str());
+				if (!(in >> node))
+					node = -1;
+			}
 
+			return node;
 		}
 };
 
+/*
+ * Top levels of the tree are listed up front and split into units: files
+ * found there form unit 0, every directory below the last listed level is
+ * a unit of its own. Walker threads claim units and feed files of their
+ * subtrees into lock-free queue, workers only pop from it. Directories are
+ * read with getdents64 and d_type, so only symlinks and filesystems
+ * without d_type need stat() while walking.
+ */
 class fs_processor : public generic_processor {
 	public:
-		fs_processor(const std::string &path) : itr_(fs::path(path)) {
+		fs_processor(const std::string &path, const struct dnet_shard &shard, uint64_t start = 0,
+				int walkers = 1, uint64_t processed = 0) :
+				generic_processor(shard), queue_(queue_size), low_(start), unit_(start), done_(0),
+				walkers_done_(0), walkers_num_(std::max(walkers, 1)), stop_(false), failed_(false) {
+			std::vector<std::string> dirs(1, path);
+			dirent_buffer buf;
+
+			for (int depth = 0; depth < expand_depth && !dirs.empty() &&
+					dirs.size() < (size_t)walkers_num_ * expand_ratio; ++depth) {
+				std::vector<std::string> next;
+
+				for (std::vector<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+					if (list(*it, buf, UINT64_MAX, next) < 0)
+						failed_ = true;
+					top_.push_back(*it);
+				}
+
+				dirs.swap(next);
+			}
+
+			/* same tree gives same units, so resume position stays valid */
+			std::sort(dirs.begin(), dirs.end());
+
+			units_.resize(dirs.size() + 1);
+			for (size_t i = 0; i < dirs.size(); ++i)
+				units_[i + 1].path = dirs[i];
+
+			done_ = processed;
+
+			for (int i = 0; i < walkers_num_; ++i)
+				walkers_.create_thread(boost::bind(&fs_processor::walk, this));
 		}
 
-		processor_key next(void) {
-			processor_key key;
+		/* workers may be gone already, walkers must not wait for queue space then */
+		virtual ~fs_processor() {
+			__atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+			walkers_.join_all();
+		}
+
+		/* position is number of units completely walked and processed */
+		uint64_t position(uint64_t *processed) {
+			while (low_ < units_.size()) {
+				unit &u = units_[low_];
+
+				if (!__atomic_load_n(&u.walked, __ATOMIC_ACQUIRE) ||
+						__atomic_load_n(&u.pending, __ATOMIC_SEQ_CST))
+					break;
+
+				done_ += u.files;
+				++low_;
+			}
+
+			*processed = done_;
+			return low_ < units_.size() ? low_ : UINT64_MAX;
+		}
+
+		bool next(processor_key &key) {
+			uint64_t *cur = current_.get();
+			struct stat st;
+
+			if (!cur) {
+				cur = new uint64_t(UINT64_MAX);
+				current_.reset(cur);
+			}
 
 			while (true) {
-				if (itr_ == end_itr_) {
-					throw std::runtime_error("Whole directory has been traversed");
-				}
+				/* previous key is done once worker asks for the next one */
+				release();
+
+				if (!pop(key))
+					return false;
+
+				*cur = key.seq;
 
-				if (fs::is_directory(itr_->path())) {
-					++itr_;
+				if (stat(key.path.c_str(), &st) || st.st_size == 0)
 					continue;
+
+				key.size = st.st_size;
+				key.file_size = st.st_size;
+				return true;
+			}
+		}
+
+		bool failed(void) {
+			return __atomic_load_n(&failed_, __ATOMIC_ACQUIRE);
+		}
+
+		void release(void) {
+			uint64_t *cur = current_.get();
+
+			if (cur && *cur != UINT64_MAX) {
+				__atomic_sub_fetch(&units_[*cur].pending, 1, __ATOMIC_SEQ_CST);
+				*cur = UINT64_MAX;
+			}
+		}
+
+	private:
+		static const size_t queue_size = 64 * 1024;
+		static const int expand_depth = 3;
+		static const int expand_ratio = 8;
+		static const size_t dirent_buffer_size = 64 * 1024;
+		static const unsigned int backoff_yields = 64;
+		static const unsigned int backoff_max_shift = 10;	/* up to ~1 ms sleep */
+
+		struct unit {
+			unit() : pending(0), files(0), walked(false) {}
+
+			std::string path;
+			uint64_t pending;	/* files pushed but not yet processed */
+			uint64_t files;
+			bool walked;
+		};
+
+		struct linux_dirent64 {
+			uint64_t d_ino;
+			int64_t d_off;
+			unsigned short d_reclen;
+			unsigned char d_type;
+			char d_name[];
+		};
+
+		typedef std::vector<char> dirent_buffer;
+
+		mpmc_queue<processor_key> queue_;
+		std::vector<std::string> top_;		/* directories whose files are unit 0 */
+		std::vector<unit> units_;
+		uint64_t low_;
+		uint64_t unit_;
+		uint64_t done_;
+		int walkers_done_;
+		int walkers_num_;
+		bool stop_;
+		bool failed_;
+		boost::thread_group walkers_;
+		boost::thread_specific_ptr<uint64_t> current_;
+
+		/*
+		 * Waiting on empty or full queue: short waits only yield, longer
+		 * ones sleep with growing interval, so idle workers do not keep
+		 * a core busy each while walk is slow.
+		 */
+		static void backoff(unsigned int &step) {
+			if (step < backoff_yields)
+				sched_yield();
+			else
+				usleep(1U << (step - backoff_yields));
+
+			if (step < backoff_yields + backoff_max_shift)
+				++step;
+		}
+
+		bool pop(processor_key &key) {
+			unsigned int step = 0;
+
+			while (!queue_.pop(key)) {
+				if (__atomic_load_n(&walkers_done_, __ATOMIC_ACQUIRE) == walkers_num_) {
+					/* walkers could push their last keys right before finishing */
+					return queue_.pop(key);
 				}
 
-				if (itr_->leaf().size() != DNET_ID_SIZE * 2) {
-					++itr_;
-					continue;
+				backoff(step);
+			}
+
+			return true;
+		}
+
+		/*
+		 * Collects subdirectories and pushes files with key-like names as
+		 * part of unit @num unless it is UINT64_MAX, returns negative errno
+		 * if directory can not be read.
+		 */
+		int list(const std::string &dir, dirent_buffer &buf, uint64_t num, std::vector<std::string> &dirs) {
+			struct stat st;
+			long nread = 0;
+			int fd;
+
+			fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+			if (fd < 0) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "%s: failed to open directory: %s\n",
+						dir.c_str(), strerror(errno));
+				return -errno;
+			}
+
+			buf.resize(dirent_buffer_size);
+
+			while (!stopped() && (nread = syscall(SYS_getdents64, fd, &buf[0], buf.size())) > 0) {
+				for (long pos = 0; pos < nread; ) {
+					struct linux_dirent64 *d = (struct linux_dirent64 *)&buf[pos];
+					unsigned char type = d->d_type;
+
+					pos += d->d_reclen;
+
+					if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+						continue;
+
+					if (type == DT_UNKNOWN || type == DT_LNK) {
+						if (fstatat(fd, d->d_name, &st, 0))
+							continue;
+
+						type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+						/* symlinked directories are not followed */
+						if (type == DT_DIR && d->d_type == DT_LNK)
+							continue;
+					}
+
+					if (type == DT_DIR)
+						dirs.push_back(dir + "/" + d->d_name);
+					else if (type == DT_REG && num != UINT64_MAX && strlen(d->d_name) == DNET_ID_SIZE * 2)
+						push(num, dir + "/" + d->d_name);
 				}
+			}
+
+			if (nread < 0) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "%s: failed to read directory: %s\n",
+						dir.c_str(), strerror(errno));
+				nread = -errno;
+			}
 
-				parse(itr_->leaf(), key.id);
-				key.path = itr_->path().string();
-				key.offset = 0;
-				key.size = fs::file_size(itr_->path());
+			close(fd);
+			return nread;
+		}
 
-				if (key.size == 0) {
-					++itr_;
-					continue;
+		void push(uint64_t num, const std::string &path) {
+			processor_key key;
+			unsigned int step = 0;
+
+			key.path = path;
+			parse(path.substr(path.size() - DNET_ID_SIZE * 2), key.id);
+			if (!in_shard(key.id))
+				return;
+
+			key.offset = 0;
+			key.size = 0;
+			key.seq = num;
+
+			dnet_conv_log(DNET_CONV_LOG_KEY, "fs: %s\n", key.path.c_str());
+
+			__atomic_add_fetch(&units_[num].pending, 1, __ATOMIC_SEQ_CST);
+			units_[num].files++;
+
+			while (!queue_.push(key)) {
+				if (stopped())
+					return;
+
+				backoff(step);
+			}
+		}
+
+		bool stopped(void) {
+			return __atomic_load_n(&stop_, __ATOMIC_ACQUIRE);
+		}
+
+		/* returns negative errno if some directory of the unit could not be read */
+		int walk_unit(uint64_t num, dirent_buffer &buf) {
+			std::vector<std::string> dirs;
+			int err = 0, ret;
+
+			if (num == 0) {
+				/* subdirectories of listed levels are units already */
+				for (std::vector<std::string>::iterator it = top_.begin(); it != top_.end(); ++it) {
+					ret = list(*it, buf, num, dirs);
+					if (ret < 0)
+						err = ret;
+					dirs.clear();
 				}
+				return err;
+			}
+
+			dirs.push_back(units_[num].path);
 
-				std::cout << "fs: " << itr_->path() << std::endl;
-				key.file.reset(new boost::iostreams::mapped_file(key.path, std::ios_base::in | std::ios_base::binary));
+			while (!dirs.empty() && !stopped()) {
+				std::string dir = dirs.back();
 
-				++itr_;
-				break;
+				dirs.pop_back();
+				ret = list(dir, buf, num, dirs);
+				if (ret < 0)
+					err = ret;
 			}
-			return key;
+
+			return err;
 		}
 
-	private:
-		fs::recursive_directory_iterator end_itr_, itr_;
-		std::vector<std::string> dirs_;
+		void walk(void) {
+			dirent_buffer buf;
+			uint64_t num;
+
+			try {
+				/* units below resume position were handled before checkpoint */
+				while (!stopped() && (num = __atomic_fetch_add(&unit_, 1, __ATOMIC_SEQ_CST)) < units_.size()) {
+					/* partially walked unit must not be counted as done, resume walks it again */
+					if (walk_unit(num, buf) < 0)
+						__atomic_store_n(&failed_, true, __ATOMIC_RELEASE);
+					else if (!stopped())
+						__atomic_store_n(&units_[num].walked, true, __ATOMIC_RELEASE);
+				}
+			} catch (const std::exception &e) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "Directory walk failed: %s\n", e.what());
+				__atomic_store_n(&failed_, true, __ATOMIC_RELEASE);
+			}
+
+			__atomic_add_fetch(&walkers_done_, 1, __ATOMIC_RELEASE);
+		}
 
 		void parse(const std::string &value, std::string &key) {
 			unsigned char ch[5];
@@ -207,98 +889,629 @@ class fs_processor : public generic_processor {
 
 };
 
+enum io_engine_type {
+	IO_ENGINE_MMAP = 0,
+	IO_ENGINE_PREAD,
+	IO_ENGINE_URING,
+};
+
+/*
+ * Per-thread object reader used for checksum calculation.
+ * Objects are consumed in chunks: start() is called once per object,
+ * then read() and release() for every chunk in order.
+ * Non-mmap engines read into reusable page aligned buffer of chunk size,
+ * the last opened file descriptor is cached.
+ */
+class io_engine {
+	public:
+		io_engine() : fd_(-1), buf_(NULL), buf_size_(0) {}
+
+		virtual ~io_engine() {
+			if (fd_ >= 0)
+				close(fd_);
+			free(buf_);
+		}
+
+		virtual int start(const processor_key &key) {
+			int err;
+
+			err = open_file(key.path);
+			if (err)
+				return err;
+
+			posix_fadvise(fd_, key.offset, key.size, POSIX_FADV_SEQUENTIAL);
+			return 0;
+		}
+
+		/* sets @data to object content at [@offset, @offset + @size), returns negative errno on error */
+		virtual int read(const processor_key &key, uint64_t offset, size_t size, const char **data) = 0;
+
+		/* chunk has been consumed, drop it from page cache */
+		virtual void release(const processor_key &key, uint64_t offset, size_t size) {
+			posix_fadvise(fd_, key.offset + offset, size, POSIX_FADV_DONTNEED);
+		}
+
+	protected:
+		static const size_t align = 4096;
+		static const size_t segment_size = 1024 * 1024;
+
+		std::string path_;
+		int fd_;
+		char *buf_;
+		size_t buf_size_;
+
+		int open_file(const std::string &path) {
+			if (fd_ >= 0 && path == path_)
+				return 0;
+
+			if (fd_ >= 0) {
+				close(fd_);
+				path_.clear();
+			}
+
+			fd_ = open(path.c_str(), O_RDONLY);
+			if (fd_ < 0) {
+				fd_ = -1;
+				return -errno;
+			}
+
+			path_ = path;
+			return 0;
+		}
+
+		int reserve(size_t size) {
+			void *buf;
+
+			if (size <= buf_size_)
+				return 0;
+
+			size = (size + align - 1) & ~(align - 1);
+			if (posix_memalign(&buf, align, size))
+				return -ENOMEM;
+
+			free(buf_);
+			buf_ = (char *)buf;
+			buf_size_ = size;
+			return 0;
+		}
+
+		int read_range(char *dst, size_t size, uint64_t offset) {
+			ssize_t err;
+
+			while (size) {
+				err = pread(fd_, dst, size, offset);
+				if (err < 0) {
+					if (errno == EINTR)
+						continue;
+					return -errno;
+				}
+				if (err == 0)
+					return -EIO;
+
+				dst += err;
+				size -= err;
+				offset += err;
+			}
+
+			return 0;
+		}
+};
+
+/*
+ * Maps only the object being checksummed, mapping is dropped when the next
+ * object is started or the engine is destroyed.
+ */
+class mmap_engine : public io_engine {
+	public:
+		mmap_engine() : map_(NULL), map_size_(0), map_offset_(0) {}
+
+		~mmap_engine() {
+			unmap();
+		}
+
+		int start(const processor_key &key) {
+			int err;
+
+			unmap();
+
+			err = io_engine::start(key);
+			if (err)
+				return err;
+
+			if (!key.size)
+				return 0;
+
+			map_offset_ = key.offset & ~(uint64_t)(align - 1);
+			map_size_ = key.offset + key.size - map_offset_;
+
+			map_ = (char *)mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd_, map_offset_);
+			if (map_ == MAP_FAILED) {
+				map_ = NULL;
+				return -errno;
+			}
+
+			madvise(map_, map_size_, MADV_SEQUENTIAL);
+			return 0;
+		}
+
+		int read(const processor_key &key, uint64_t offset, size_t, const char **data) {
+			*data = map_ + (key.offset - map_offset_) + offset;
+			return 0;
+		}
+
+		void release(const processor_key &key, uint64_t offset, size_t size) {
+			/* only pages fully covered by the chunk, neighbours may still be in use */
+			char *start = page_up(map_ + (key.offset - map_offset_) + offset);
+			char *end = page_down(map_ + (key.offset - map_offset_) + offset + size);
+
+			if (end > start)
+				madvise(start, end - start, MADV_DONTNEED);
+
+			io_engine::release(key, offset, size);
+		}
+
+	private:
+		char *map_;
+		size_t map_size_;
+		uint64_t map_offset_;
+
+		void unmap(void) {
+			if (map_)
+				munmap(map_, map_size_);
+			map_ = NULL;
+		}
+
+		static char *page_down(const char *ptr) {
+			return (char *)((uintptr_t)ptr & ~(uintptr_t)(align - 1));
+		}
+
+		static char *page_up(const char *ptr) {
+			return page_down(ptr + align - 1);
+		}
+};
+
+class pread_engine : public io_engine {
+	public:
+		int read(const processor_key &key, uint64_t offset, size_t size, const char **data) {
+			int err;
+
+			err = reserve(size);
+			if (err)
+				return err;
+
+			err = read_range(buf_, size, key.offset + offset);
+			if (err)
+				return err;
+
+			*data = buf_;
+			return 0;
+		}
+};
+
+#ifdef HAVE_LIBURING
+/*
+ * Chunk is split into segments, up to @depth of them are in flight at once.
+ */
+class uring_engine : public io_engine {
+	public:
+		uring_engine(int depth) : depth_(depth) {
+			int err = io_uring_queue_init(depth_, &ring_, 0);
+			if (err < 0)
+				throw std::runtime_error(std::string("io_uring_queue_init failed: ") + strerror(-err));
+		}
+
+		~uring_engine() {
+			io_uring_queue_exit(&ring_);
+		}
+
+		int read(const processor_key &key, uint64_t offset, size_t size, const char **data) {
+			struct io_uring_sqe *sqe;
+			struct io_uring_cqe *cqe;
+			uint64_t submitted = 0, off;
+			size_t len;
+			int inflight = 0;
+			int err, res;
+
+			err = reserve(size);
+			if (err)
+				return err;
+
+			while ((!err && submitted < size) || inflight) {
+				while (!err && submitted < size && inflight < depth_) {
+					sqe = io_uring_get_sqe(&ring_);
+					if (!sqe)
+						break;
+
+					len = std::min<uint64_t>(segment_size, size - submitted);
+					io_uring_prep_read(sqe, fd_, buf_ + submitted, len, key.offset + offset + submitted);
+					io_uring_sqe_set_data(sqe, (void *)(uintptr_t)submitted);
+
+					submitted += len;
+					inflight++;
+				}
+
+				res = io_uring_submit_and_wait(&ring_, 1);
+				if (res == -EINTR)
+					continue;
+				if (res < 0) {
+					reset();
+					return res;
+				}
+
+				res = io_uring_peek_cqe(&ring_, &cqe);
+				if (res < 0)
+					continue;
+
+				off = (uintptr_t)io_uring_cqe_get_data(cqe);
+				len = std::min<uint64_t>(segment_size, size - off);
+				res = cqe->res;
+				io_uring_cqe_seen(&ring_, cqe);
+				inflight--;
+
+				if (res < 0) {
+					if (!err)
+						err = res;
+					continue;
+				}
+
+				/* short reads are completed synchronously */
+				if ((size_t)res < len && !err)
+					err = read_range(buf_ + off + res, len - res, key.offset + offset + off + res);
+			}
+
+			if (err)
+				return err;
+
+			*data = buf_;
+			return 0;
+		}
+
+	private:
+		int depth_;
+		struct io_uring ring_;
+
+		void reset(void) {
+			io_uring_queue_exit(&ring_);
+			if (io_uring_queue_init(depth_, &ring_, 0) < 0)
+				throw std::runtime_error("io_uring reinitialization failed");
+		}
+};
+#endif
+
+static io_engine *create_io_engine(int type, int depth)
+{
+#ifndef HAVE_LIBURING
+	(void)depth;
+#endif
+
+	switch (type) {
+		case IO_ENGINE_PREAD:
+			return new pread_engine();
+#ifdef HAVE_LIBURING
+		case IO_ENGINE_URING:
+			return new uring_engine(depth);
+#endif
+		default:
+			return new mmap_engine();
+	}
+}
+
+static int parse_io_engine(const std::string &name)
+{
+	if (name == "mmap")
+		return IO_ENGINE_MMAP;
+	if (name == "pread")
+		return IO_ENGINE_PREAD;
+	if (name == "uring") {
+#ifdef HAVE_LIBURING
+		return IO_ENGINE_URING;
+#else
+		std::cerr << "io_uring support is not compiled in, falling back to pread" << std::endl;
+		return IO_ENGINE_PREAD;
+#endif
+	}
+
+	throw std::runtime_error("Unknown io engine: " + name);
+}
+
 class remote_update {
 	public:
 		remote_update(const std::vector<int> groups, const std::string meta, struct timespec update_date) :
-				 groups_(groups), meta_(meta), update_date_(update_date), aflags_(0) {
+				 groups_(groups), meta_(meta), use_index_(false), dry_run_(false), created_(0),
+				 running_(0), failed_(0), aflags_(0), update_date_(update_date),
+				 io_type_(IO_ENGINE_PREAD), io_depth_(32), chunk_size_(8 * 1024 * 1024) {
 		}
 
-		void process(const std::string &path, int tnum = 16, int csum_enabled = 0) {
+		void process(const std::string &path, int tnum = 16, int csum_enabled = 0,
+				int io_type = IO_ENGINE_PREAD, int io_depth = 32, uint64_t chunk_size = 8 * 1024 * 1024,
+				bool resume = false, const struct dnet_shard &shard = dnet_shard(), bool numa = false,
+				bool use_index = false, bool dry_run = false) {
+			struct dnet_checkpoint_data resume_data;
+			std::string ckpt_path = meta_ + ".files.checkpoint";
+			uint64_t start = 0;
 			generic_processor *proc;
 			struct eblob_backend *meta = NULL;
 			struct eblob_config ecfg;
 			struct eblob_log log;
+			int err;
 
 			if (!csum_enabled)
 				aflags_ |= DNET_ATTR_NOCSUM;
 
+			io_type_ = io_type;
+			io_depth_ = io_depth;
+			chunk_size_ = chunk_size ? chunk_size : 8 * 1024 * 1024;
+
+			total_cnt = 0;
+
+			if (resume) {
+				err = dnet_checkpoint_load(ckpt_path.c_str(), &resume_data);
+				if (err || resume_data.pos_size != sizeof(start))
+					throw std::runtime_error("Failed to load checkpoint " + ckpt_path);
+
+				memcpy(&start, resume_data.pos, sizeof(start));
+				total_cnt = resume_data.processed;
+				std::cerr << "Resuming after " << total_cnt << " processed records" << std::endl;
+			}
+
+			std::vector<int> cpu_nodes;
+			int nodes = numa ? numa_nodes(cpu_nodes) : 0;
+
 			if (fs::is_directory(fs::path(path))) {
-				proc = new fs_processor(path);
+				proc = new fs_processor(path, shard, start, tnum, total_cnt);
 			} else {
-				proc = new eblob_processor(path);
+				proc = new eblob_processor(path, shard, start, nodes);
 			}
 
-			total_cnt = 0;
+			/* dry run never opens meta blob, existing records are read through its index */
+			dry_run_ = dry_run;
+			if (dry_run)
+				use_index = true;
+
+			memset(&index_, 0, sizeof(index_));
+			use_index_ = use_index;
+			if (use_index) {
+				err = dnet_meta_index_build(&index_, meta_.c_str());
+				if (err) {
+					delete proc;
+					throw std::runtime_error("Failed to load meta index");
+				}
+
+				std::cerr << "Loaded meta index of " << index_.num << " records" << std::endl;
+			}
 
 			memset(&ecfg, 0, sizeof(ecfg));
 			ecfg.file = (char *)meta_.c_str();
 			ecfg.sync = 30;
 
-			log.log = dnet_common_log;
-			log.log_private = NULL;
-			log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
-			ecfg.log = &log;
+			if (!dry_run) {
+				log.log = dnet_common_log;
+				log.log_private = NULL;
+				log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
+				ecfg.log = &log;
+
+				meta = eblob_init(&ecfg);
+				if (!meta) {
+					std::cerr << "Failed to open meta database" << meta_ << std::endl;
+					dnet_meta_index_destroy(&index_);
+					throw std::runtime_error("Failed to open meta database");
+				}
+			}
 
-			meta = eblob_init(&ecfg);
-			if (!meta) {
-				std::cerr << "Failed to open meta database" << meta_ << std::endl;
-				throw std::runtime_error("Failed to open meta database");
+			err = dnet_meta_writer_start(&writer_, meta, NULL, DNET_META_WRITER_QUEUE_SIZE);
+			if (err) {
+				std::cerr << "Failed to start meta writer: " << err << std::endl;
+				if (meta)
+					eblob_cleanup(meta);
+				dnet_meta_index_destroy(&index_);
+				throw std::runtime_error("Failed to start meta writer");
 			}
 
+			if (!dry_run) {
+				err = dnet_checkpoint_init(&ckpt_, ckpt_path.c_str(), &writer_, ecfg.sync + 1);
+				if (err) {
+					dnet_meta_writer_stop(&writer_);
+					eblob_cleanup(meta);
+					dnet_meta_index_destroy(&index_);
+					throw std::runtime_error("Failed to init checkpoint");
+				}
+			}
+
+			uint64_t total = proc->total() / std::max(shard.num, 1U);
+
+			created_ = 0;
+			failed_ = 0;
+			dnet_conv_progress_start(&remote_update::processed, this, total);
+
 			try {
 				boost::thread_group threads;
 				for (int i=0; i<tnum; ++i) {
-					threads.create_thread(boost::bind(&remote_update::process_data, this, proc, meta));
+					__atomic_fetch_add(&running_, 1, __ATOMIC_RELAXED);
+					threads.create_thread(boost::bind(&remote_update::process_data, this, proc, meta,
+								nodes ? cpu_nodes[i % cpu_nodes.size()] : -1));
+				}
+
+				while (__atomic_load_n(&running_, __ATOMIC_ACQUIRE)) {
+					boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+					if (!dry_run)
+						checkpoint(proc);
 				}
 
 				threads.join_all();
 			} catch (const std::exception &e) {
 				std::cerr << "Finished processing " << path << " : " << e.what() << std::endl;
-				eblob_cleanup(meta);
+				dnet_meta_writer_stop(&writer_);
+				dnet_conv_progress_stop();
+				if (!dry_run)
+					dnet_checkpoint_cleanup(&ckpt_, 0);
+				if (meta)
+					eblob_cleanup(meta);
+				dnet_meta_index_destroy(&index_);
 				delete proc;
 				std::cerr << "Totally processed " << total_cnt << " records" << std::endl;
 				throw e;
 			}
-			std::cerr << "1Totally processed " << total_cnt << " records" << std::endl;
-			eblob_cleanup(meta);
+			dnet_meta_writer_stop(&writer_);
+			dnet_conv_progress_stop();
+
+			/* records of failed worker or unreadable input are not converted, keep checkpoint for resume */
+			bool failed = __atomic_load_n(&failed_, __ATOMIC_SEQ_CST) || proc->failed();
+			if (!dry_run)
+				dnet_checkpoint_cleanup(&ckpt_, !failed);
+			std::cerr << "Totally processed " << total_cnt << " records, written: " << writer_.written <<
+				", write errors: " << writer_.errors << std::endl;
+			if (dry_run)
+				dnet_meta_writer_report(&writer_, total_cnt, created_, total);
+			if (meta)
+				eblob_cleanup(meta);
+			dnet_meta_index_destroy(&index_);
 
 			delete proc;
+
+			if (failed)
+				throw std::runtime_error("Some records were not processed, rerun with --resume to continue");
 		}
 
 	private:
 		std::vector<int> groups_;
 		std::string meta_;
-		boost::mutex data_lock_;
+		struct dnet_meta_writer writer_;
+		struct dnet_checkpoint ckpt_;
+		struct dnet_meta_index index_;
+		bool use_index_;
+		bool dry_run_;
+		uint64_t created_;
+		int running_;
+		int failed_;
 		int aflags_;
 		uint64_t total_cnt;
 		struct timespec update_date_;
+		int io_type_;
+		int io_depth_;
+		uint64_t chunk_size_;
+
+		static uint64_t processed(void *priv) {
+			return ((remote_update *)priv)->total_cnt;
+		}
+
+		/*
+		 * Processor position already accounts for work in progress,
+		 * so checkpoint only has to wait for the writer and eblob sync.
+		 */
+		void checkpoint(generic_processor *proc) {
+			uint64_t pos, processed;
 
-		void update(generic_processor *proc, processor_key &key, struct eblob_backend *meta) {
+			dnet_checkpoint_poll(&ckpt_, 1);
+
+			if (dnet_checkpoint_need(&ckpt_)) {
+				pos = proc->position(&processed);
+
+				/* failed worker may have released a record it did not finish */
+				if (__atomic_load_n(&failed_, __ATOMIC_SEQ_CST))
+					return;
+
+				if (pos != UINT64_MAX)
+					dnet_checkpoint_take(&ckpt_, &pos, sizeof(pos), processed);
+			}
+		}
+
+		/*
+		 * Same SHA-512 eblob_hash() produces, but calculated incrementally
+		 * so only one chunk of the object is resident at a time.
+		 */
+		int hash(io_engine *io, const processor_key &key, uint8_t *checksum, unsigned int size) {
+			unsigned char digest[EVP_MAX_MD_SIZE];
+			unsigned int digest_size;
+			const char *data;
+			uint64_t offset;
+			size_t len;
+			EVP_MD_CTX *ctx;
+			int err;
+
+			err = io->start(key);
+			if (err)
+				return err;
+
+			ctx = EVP_MD_CTX_create();
+			if (!ctx)
+				return -ENOMEM;
+
+			if (!EVP_DigestInit_ex(ctx, EVP_sha512(), NULL)) {
+				err = -EIO;
+				goto err_out_destroy;
+			}
+
+			for (offset = 0; offset < key.size; offset += len) {
+				len = std::min<uint64_t>(chunk_size_, key.size - offset);
+
+				err = io->read(key, offset, len, &data);
+				if (err)
+					goto err_out_destroy;
+
+				if (!EVP_DigestUpdate(ctx, data, len))
+					err = -EIO;
+				io->release(key, offset, len);
+				if (err)
+					goto err_out_destroy;
+			}
+
+			if (!EVP_DigestFinal_ex(ctx, digest, &digest_size)) {
+				err = -EIO;
+				goto err_out_destroy;
+			}
+
+			memset(checksum, 0, size);
+			memcpy(checksum, digest, std::min(size, digest_size));
+
+err_out_destroy:
+			EVP_MD_CTX_destroy(ctx);
+			return err;
+		}
+
+		void update(generic_processor *proc, processor_key &key, struct eblob_backend *meta,
+				struct dnet_meta_arena *arena, io_engine *io) {
 			struct dnet_raw_id id;
 			struct dnet_meta *m;
 			struct dnet_meta_container mc;
 			struct dnet_meta_checksum *csum;
-			struct dnet_meta *mp;
 			uint8_t checksum[DNET_CSUM_SIZE];
+			uint64_t start;
 			int err;
 
-			if (key.offset + key.size > key.file->size()) {
-				std::cout << "failed. " << dnet_dump_id_str(id.id) << ": incorrect length: "
-				<< "offset=" << key.offset << ", size=" << key.size << ", file.size=" << key.file->size() << std::endl;
+			memset(&mc, 0, sizeof(mc));
+			memcpy(&mc.id, (unsigned char *)key.id.data(), DNET_ID_SIZE);
+
+			if (key.offset + key.size > key.file_size) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s failed. incorrect length: "
+						"offset=%llu, size=%llu, file.size=%llu\n",
+						dnet_dump_id_len(&mc.id, DNET_ID_SIZE),
+						(unsigned long long)key.offset, (unsigned long long)key.size,
+						(unsigned long long)key.file_size);
 				return;
 			}
 
-			memset(&mc, 0, sizeof(mc));
+			memcpy(&id.id, (unsigned char *)key.id.data(), DNET_ID_SIZE);
 
-			memcpy(&mc.id, (unsigned char *)key.id.data(), DNET_ID_SIZE);
-			std::cout << "Processing " << dnet_dump_id_len(&mc.id, DNET_ID_SIZE) << " ";
+			start = dnet_conv_stat_start();
 
-			memcpy(&id.id, (unsigned char *)key.id.data(), DNET_ID_SIZE);
-			err = dnet_db_read_raw(meta, &id, &mc.data);
+			/* record content is only needed to verify checksum */
+			if (use_index_ && !dnet_meta_index_exists(&index_, id.id))
+				err = -ENOENT;
+			else if (use_index_ && (aflags_ & DNET_ATTR_NOCSUM)) {
+				dnet_conv_stat_end(DNET_CONV_STAT_META_READ, start);
+				return;
+			}
+			else if (dry_run_ && (err = dnet_meta_index_lookup(&index_, id.id, arena)) > 0)
+				mc.data = arena->data;
+			else if (!dry_run_)
+				err = dnet_db_read_raw(meta, &id, &mc.data);
+
+			dnet_conv_stat_end(DNET_CONV_STAT_META_READ, start);
 			if (err == -ENOENT) {
 				struct dnet_meta_create_control ctl;
 
-				std::cout << "not found. Re-creating metadata" << std::endl;
+				dnet_conv_log(DNET_CONV_LOG_KEY, "Processing %s not found. Re-creating metadata\n",
+						dnet_dump_id_len(&mc.id, DNET_ID_SIZE));
 
 				memset(&ctl, 0, sizeof(ctl));
 
@@ -309,75 +1522,172 @@ class remote_update {
 				ctl.group_num = groups_.size();
 
 				if (!(aflags_ & DNET_ATTR_NOCSUM)) {
-					eblob_hash(meta, ctl.checksum, sizeof(ctl.checksum), key.file->const_data() + key.offset, key.size);
+					start = dnet_conv_stat_start();
+					err = hash(io, key, ctl.checksum, sizeof(ctl.checksum));
+					dnet_conv_stat_end(DNET_CONV_STAT_HASH, start);
+					if (err) {
+						dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s failed. data read failed, err: %d\n",
+								dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
+						return;
+					}
 				}
 
 				dnet_setup_id(&ctl.id, 0, id.id);
 
 				ctl.ts = update_date_;
 
-				err = dnet_create_write_meta(&ctl, &mc.data);
+				start = dnet_conv_stat_start();
+				mc.data = dnet_meta_arena_reserve(arena, dnet_create_meta_size(&ctl));
+				if (!mc.data) {
+					dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s Metadata re-creating failed! err: %d\n",
+							dnet_dump_id_len(&mc.id, DNET_ID_SIZE), -ENOMEM);
+					return;
+				}
+
+				err = dnet_create_write_meta_buf(&ctl, mc.data, arena->size);
+				dnet_conv_stat_end(DNET_CONV_STAT_META_BUILD, start);
 				if (err <= 0) {
-					std::cout << "Metadata re-creating failed! err: " << err << std::endl;
+					dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s Metadata re-creating failed! err: %d\n",
+							dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
 					return;
 				}
 
 				mc.size = err;
-				err = dnet_db_write_raw(meta, &id, mc.data, mc.size);
+				err = dnet_meta_writer_queue(&writer_, &id, mc.data, mc.size);
 				if (err) {
-					std::cout << "Metadata write failed! err: " << err << std::endl;
+					dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s Metadata queue failed! err: %d\n",
+							dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
+				} else {
+					__atomic_fetch_add(&created_, 1, __ATOMIC_RELAXED);
 				}
+				return;
 
 			} else if (err <= 0) {
-				std::cout << "failed. " << dnet_dump_id_str(id.id) << ": meta DB read failed, err: " << err << std::endl;
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s failed. meta DB read failed, err: %d\n",
+						dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
 				return;
 			} else if (err > 0 && !(aflags_ & DNET_ATTR_NOCSUM)) {
 				mc.size = err;
 
-				mp = dnet_meta_search_cust(&mc, DNET_META_CHECKSUM);
-				if (mp) {
-					csum = (struct dnet_meta_checksum *)mp->data;
-					eblob_hash(meta, checksum, sizeof(checksum), key.file->const_data() + key.offset, key.size);
-					if (memcmp(csum->checksum, checksum, DNET_CSUM_SIZE)) {
-						std::cout << "Checksum mismatch, updating with the new one" << std::endl;
+				dnet_meta_view_ref view(mc.data, mc.size);
+
+				csum = view.get<struct dnet_meta_checksum>(DNET_META_CHECKSUM);
+				if (csum) {
+					start = dnet_conv_stat_start();
+					err = hash(io, key, checksum, sizeof(checksum));
+					dnet_conv_stat_end(DNET_CONV_STAT_HASH, start);
+					if (err) {
+						dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s failed. data read failed, err: %d\n",
+								dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
+					} else if (memcmp(csum->checksum, checksum, DNET_CSUM_SIZE)) {
+						dnet_conv_log(DNET_CONV_LOG_KEY, "Processing %s Checksum mismatch, updating with the new one\n",
+								dnet_dump_id_len(&mc.id, DNET_ID_SIZE));
 
 						memcpy(csum->checksum, checksum, DNET_CSUM_SIZE);
 						dnet_current_time(&csum->tm);
 						dnet_convert_meta_checksum(csum);
 
-						err = dnet_db_write_raw(meta, &id, mc.data, mc.size);
+						err = dnet_meta_writer_queue(&writer_, &id, mc.data, mc.size);
 						if (err) {
-							std::cout << "Metadata write failed! err: " << err << std::endl;
+							dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing %s Metadata queue failed! err: %d\n",
+									dnet_dump_id_len(&mc.id, DNET_ID_SIZE), err);
 						}
 					}
 				}
 
 			}
 
-			free(mc.data);
+			/* dry run reads into arena, it is reused by the next key */
+			if (!dry_run_)
+				free(mc.data);
 		}
 
-		void process_data(generic_processor *proc, struct eblob_backend *meta) {
+		/*
+		 * Number of NUMA nodes blobs are spread over, 0 if placement is not
+		 * possible. Workers are only spread over @cpu_nodes, nodes with CPUs
+		 * this process may run on; memory-only nodes can not host them.
+		 */
+		static int numa_nodes(std::vector<int> &cpu_nodes) {
+#ifdef HAVE_LIBNUMA
+			if (numa_available() >= 0) {
+				struct bitmask *cpus = numa_allocate_cpumask();
+
+				for (int node = 0; cpus && node <= numa_max_node(); ++node) {
+					if (numa_node_to_cpus(node, cpus))
+						continue;
+
+					for (unsigned int cpu = 0; cpu < cpus->size; ++cpu) {
+						if (numa_bitmask_isbitset(cpus, cpu) && numa_bitmask_isbitset(numa_all_cpus_ptr, cpu)) {
+							cpu_nodes.push_back(node);
+							break;
+						}
+					}
+				}
+
+				if (cpus)
+					numa_free_cpumask(cpus);
+
+				if (!cpu_nodes.empty())
+					return numa_max_node() + 1;
+			}
+#else
+			(void)cpu_nodes;
+#endif
+			std::cerr << "NUMA placement is not available, workers are not pinned" << std::endl;
+			return 0;
+		}
+
+		/* processor step timed as source read */
+		bool next(generic_processor *proc, processor_key &key) {
+			uint64_t start = dnet_conv_stat_start();
+			bool ret = proc->next(key);
+
+			dnet_conv_stat_end(DNET_CONV_STAT_SOURCE_READ, start);
+			return ret;
+		}
+
+		void process_data(generic_processor *proc, struct eblob_backend *meta, int node) {
+			struct dnet_meta_arena arena;
+			processor_key key;
+
+#ifdef HAVE_LIBNUMA
+			/* io buffers and arena are allocated below, so they end up on the same node */
+			if (node >= 0) {
+				if (numa_run_on_node(node))
+					dnet_conv_log(DNET_CONV_LOG_ERROR, "Failed to pin worker to NUMA node %d: %s\n",
+							node, strerror(errno));
+				else
+					numa_set_localalloc();
+			}
+#else
+			(void)node;
+#endif
+
+			memset(&arena, 0, sizeof(arena));
+
 			try {
-				while (true) {
-					processor_key key;
+				boost::scoped_ptr<io_engine> io(create_io_engine(io_type_, io_depth_));
 
-					{
-						boost::mutex::scoped_lock scoped_lock(data_lock_);
-						key = proc->next();
-						total_cnt++;
-					}
+				while (next(proc, key)) {
+					__atomic_fetch_add(&total_cnt, 1, __ATOMIC_RELAXED);
 
-					update(proc, key, meta);
+					update(proc, key, meta, &arena, io.get());
 				}
 			} catch (const std::exception &e) {
 				std::cerr << "Catched exception : " << e.what() << std::endl;
+				__atomic_store_n(&failed_, 1, __ATOMIC_SEQ_CST);
 			}
+
+			proc->release();
+			dnet_meta_arena_destroy(&arena);
+			__atomic_fetch_sub(&running_, 1, __ATOMIC_RELEASE);
 		}
 };
 
 int main(int argc, char *argv[])
 {
+	int ret = 0;
+
 	try {
 		namespace po = boost::program_options;
 		po::options_description desc("Options (required options are marked with *");
@@ -389,7 +1699,20 @@ int main(int argc, char *argv[])
 		struct timespec update_dt;
 		int port, family;
 		int thread_num;
+		int err;
 		int csum_enabled;
+		int log_level;
+		std::string io_engine_name;
+		int io_depth;
+		uint64_t chunk_size;
+		bool resume;
+		std::string shard_name;
+		struct dnet_shard shard;
+		bool numa;
+		bool use_index;
+		bool dry_run;
+		std::string stats;
+		std::string write_rate;
 
 		desc.add_options()
 			("help", "This help message")
@@ -400,8 +1723,28 @@ int main(int argc, char *argv[])
 			("meta", po::value<std::string>(&meta), "Meta DB")
 			("enable-checksum", po::value<int>(&csum_enabled)->default_value(0),
 			 	"Set to 1 if you want to enable server generated checksums")
+			("io-engine", po::value<std::string>(&io_engine_name)->default_value("pread"),
+				"How object data is read for checksumming: mmap, pread or uring")
+			("io-depth", po::value<int>(&io_depth)->default_value(32),
+				"Number of in-flight reads per thread for uring io engine")
+			("hash-chunk-size", po::value<uint64_t>(&chunk_size)->default_value(8 * 1024 * 1024),
+				"Objects are checksummed in chunks of this many bytes")
+			("resume", po::bool_switch(&resume), "Continue from the last checkpoint of interrupted run")
+			("shard", po::value<std::string>(&shard_name), "Process only keys of shard i out of N, given as i/N")
+			("index", po::bool_switch(&use_index),
+				"Load index of meta blob and check which keys exist in memory instead of reading records")
+			("numa", po::bool_switch(&numa),
+				"Pin workers to NUMA nodes round-robin and prefer blobs on node-local devices")
+			("stats", po::value<std::string>(&stats),
+				"Dump per-phase latency histograms as JSON into this file periodically and at exit")
+			("dry-run", po::bool_switch(&dry_run),
+				"Only count what would be written and estimate run time, meta blob is not opened")
+			("write-rate", po::value<std::string>(&write_rate),
+				"Eblob write rate assumed by dry run estimate, as records/s[:MB/s]")
 			("update-date", po::value<std::string>(&update_date)->default_value(""),
 				"Update date for created meta in format like \"2011-08-22 21:42:00\"")
+			("verbose", po::value<int>(&log_level)->default_value(DNET_CONV_LOG_KEY),
+				"Verbosity: 0 - errors only, 1 - progress and totals, 2 - every key")
 		;
 
 		po::variables_map vm;
@@ -413,10 +1756,45 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
+		if (dry_run && resume) {
+			std::cerr << "Dry run can not be combined with resume" << std::endl;
+			return -1;
+		}
+
+		memset(&shard, 0, sizeof(shard));
+		if (!shard_name.empty() && dnet_parse_shard(shard_name.c_str(), &shard)) {
+			std::cout << desc << "\n";
+			return -1;
+		}
+
+		if (!write_rate.empty() && dnet_parse_write_rate(write_rate.c_str())) {
+			std::cout << desc << "\n";
+			return -1;
+		}
+
+		if (!stats.empty()) {
+			err = dnet_conv_stat_init(stats.c_str());
+			if (err) {
+				std::cerr << "Failed to enable stats: " << err << std::endl;
+				return -1;
+			}
+		}
+
+		err = dnet_conv_log_init(log_level, DNET_CONV_PROGRESS_INTERVAL);
+		if (err) {
+			std::cerr << "Failed to start logger: " << err << std::endl;
+			return -1;
+		}
+
 		update_dt = parse_time(update_date);
 		remote_update up(groups, meta, update_dt);
-		up.process(vm["input-path"].as<std::string>(), thread_num, csum_enabled);
+		up.process(vm["input-path"].as<std::string>(), thread_num, csum_enabled,
+				parse_io_engine(io_engine_name), io_depth, chunk_size, resume, shard, numa, use_index, dry_run);
 	} catch (const std::exception &e) {
 		std::cerr << "Exiting: " << e.what() << std::endl;
+		ret = -1;
 	}
+
+	dnet_conv_log_exit();
+	return ret;
 }
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -42,49 +43,87 @@ static void hparser_usage(const char *p)
 	fprintf(stderr, " -H                   - history database to parse\n"
 			" -M                   - meta database (blob) to parse\n"
 			" -g                   - default groups for objects without meta\n"
+			" -S                   - merge-join history (must be ordered tree database) with sorted meta index\n"
+			" -r                   - continue from the last checkpoint of interrupted run\n"
+			" -s i/N               - process only keys of shard i out of N\n"
+			" -I                   - load meta index and skip lookups of keys missing in it\n"
+			" -n                   - only count what would be written, meta blob is not opened\n"
+			" -w R[:MB]            - eblob write rate assumed by dry run estimate, records/s and MB/s\n"
+			" -v                   - verbosity: 0 - errors only, 1 - progress and totals, 2 - every key (default)\n"
+			" -t file              - dump per-phase latency histograms as JSON into file\n"
 			" -h                   - this help\n");
 	exit(-1);
 }
 
 uint64_t counter = 0;
 uint64_t total = 0;
+uint64_t recreated = 0;
+int dry_run = 0;
 
 int *groups = NULL;
 int group_num = 0;
+struct dnet_shard shard;
+
+#define HPARSER_JOIN_WINDOW	4096
+
+/*
+ * History record waiting in merge-join window. @first is the first meta
+ * index entry with the same key prefix, @loc is its location.
+ */
+struct hparser_join {
+	uint64_t		loc;
+	uint64_t		first;
+	size_t			keysz;
+	size_t			datasz;
+	char			data[0];
+};
 
 struct db_ptrs {
 	struct eblob_backend *newmeta;
+	struct dnet_meta_writer	writer;
+	struct dnet_meta_arena	arena;
+
+	struct dnet_meta_index	*index;
+	struct dnet_meta_arena	read_arena;
+	struct hparser_join	*window[HPARSER_JOIN_WINDOW];
+	int			window_num;
 };
 
-static const char *hparser_visit(const char *key, size_t keysz,
-			const char *hdata, size_t datasz, size_t *sp __attribute((unused)), void *opq)
+static uint64_t hparser_processed(void *priv __attribute((unused)))
+{
+	return counter;
+}
+
+/*
+ * Patches update entry of meta record @rdata found by lookup, which
+ * returned @rsize (record size or negative error), or re-creates it.
+ * Caller owns @rdata.
+ */
+static void hparser_process(struct db_ptrs *ptrs, const char *key, size_t keysz,
+			const char *hdata, size_t datasz, void *rdata, int rsize)
 {
-	struct db_ptrs *ptrs = opq;
 	char id_str[2 * DNET_ID_SIZE + 1];
 	struct dnet_history_map hm;
 	struct dnet_meta_container mc;
+	struct dnet_meta_view view;
 	struct dnet_meta *mp, *m = NULL;
 	struct dnet_meta_update *mu;
+	uint64_t start = dnet_conv_stat_start();
+	int created = 1;
 	int err;
 	struct dnet_raw_id id;
-	char tstr[64];
-	time_t t;
-	struct tm *tm;
 
 	if (keysz != DNET_ID_SIZE) {
-		fprintf(stdout, "Incorrect key size\n");
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Incorrect key size\n");
 		goto err_out_exit;
 	}
 
 	memcpy(id.id, key, DNET_ID_SIZE);
-	dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str);
-	
-	fprintf(stdout, "Processing key %.128s  ", id_str);
-
-	if (datasz % (int)sizeof(struct dnet_history_entry)) {
-		fprintf(stdout, "Corrupted history record, "
-				"its size %d must be multiple of %zu.\n",
-				datasz, sizeof(struct dnet_history_entry));
+
+	if (!datasz || datasz % (int)sizeof(struct dnet_history_entry)) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  Corrupted history record, "
+				"its size %zu must be multiple of %zu.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), datasz, sizeof(struct dnet_history_entry));
 		goto err_out_exit;
 	}
 
@@ -93,12 +132,10 @@ static const char *hparser_visit(const char *key, size_t keysz,
 	hm.size = datasz;
 
 	dnet_setup_id(&mc.id, 0, id.id);
-	err = dnet_db_read_raw(ptrs->newmeta, &id, &mc.data);
+	err = rsize;
 	if (err == -ENOENT) {
 		struct dnet_meta_create_control ctl;
 
-		fprintf(stdout, "not found. Re-creating metadata\n");
-
 		memset(&ctl, 0, sizeof(ctl));
 
 		ctl.obj = NULL;
@@ -109,47 +146,64 @@ static const char *hparser_visit(const char *key, size_t keysz,
 
 		dnet_setup_id(&ctl.id, 0, id.id);
 
-		err = dnet_create_write_meta(&ctl, &mc.data);
+		/* reserve room for update entry too, so arena is never moved below */
+		mc.data = dnet_meta_arena_reserve(&ptrs->arena, dnet_create_meta_size(&ctl) +
+				sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update));
+		if (!mc.data) {
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  not found. "
+					"Metadata re-creating failed!\n", dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
+			goto err_out_exit;
+		}
+
+		err = dnet_create_write_meta_buf(&ctl, mc.data, ptrs->arena.size);
 		if (err <= 0) {
-			fprintf(stdout, "Metadata re-creating failed!\n");
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  not found. "
+					"Metadata re-creating failed!\n", dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
 			goto err_out_exit;
 		}
 
 	} else if (err <= 0) {
-		fprintf(stdout, "failed. %s: meta DB read failed, err: %d.\n",
-			dnet_dump_id_str(id.id), err);
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed. meta DB read failed, err: %d.\n",
+			dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), err);
 		goto err_out_exit;
+	} else {
+		mc.data = rdata;
+		created = 0;
 	}
 	mc.size = err;
 
-	mp = dnet_meta_search_cust(&mc, DNET_META_UPDATE);
+	/* broken tail is logged, update entry is appended after it as before */
+	dnet_meta_view_init(&view, mc.data, mc.size, 0);
+
+	mp = dnet_meta_view_find(&view, DNET_META_UPDATE);
 	if (!mp) {
-		// Add new meta structure after the end of current metadata
-		mc.data = realloc(mc.data, mc.size + sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update));
-		if (!mc.data) {
-			fprintf(stdout, "failed. Can't realloc.\n");
+		// Add new meta structure after the end of current metadata, record is copied into arena
+		mp = dnet_meta_arena_reserve(&ptrs->arena,
+				mc.size + sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update));
+		if (!mp) {
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed. Can't allocate.\n", dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
 			err = -ENOMEM;
-			goto err_out_free;
+			goto err_out_exit;
 		}
 
+		if (mc.data != mp)
+			memcpy(mp, mc.data, mc.size);
+		mc.data = mp;
+
 		mp = m = mc.data + mc.size;
 		mc.size += sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update);
 
 		memset(m, 0, sizeof(struct dnet_meta) + sizeof(struct dnet_meta_update));
 		m->type = DNET_META_UPDATE;
 		m->size = sizeof(struct dnet_meta_update);
-		memset(m->data, 0, m->size);
-	} else {
-		dnet_convert_meta(mp);
-	}
-
-	if (mp->size % sizeof(struct dnet_meta_update)) {
-		fprintf(stdout, "failed. Metadata is broken: entry size %u\n", mp->size);
-		goto err_out_free;
+		dnet_convert_meta(m);
+	} else if (view.size[DNET_META_UPDATE] % sizeof(struct dnet_meta_update)) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed. Metadata is broken: entry size %u\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), view.size[DNET_META_UPDATE]);
+		goto err_out_exit;
 	}
 
 	mu = (struct dnet_meta_update *)mp->data;
-	dnet_convert_meta(mp);
 
 	dnet_convert_history_entry(&hm.ent[hm.num-1]);
 
@@ -158,29 +212,309 @@ static const char *hparser_visit(const char *key, size_t keysz,
 	mu->flags = hm.ent[hm.num-1].flags & DNET_IO_FLAGS_REMOVED;
 
 	dnet_convert_meta_update(mu);
+	dnet_conv_stat_end(DNET_CONV_STAT_META_BUILD, start);
 
-	err = dnet_db_write_raw(ptrs->newmeta, &id, mc.data, mc.size);
+	err = dnet_meta_writer_queue(&ptrs->writer, &id, mc.data, mc.size);
 	if (err) {
-		fprintf(stdout, "failed to write new meta, err %d.\n", err);
-		goto err_out_free;
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed to queue new meta, err %d.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), err);
+		goto err_out_exit;
 	}
 
-	fprintf(stdout, "ok. Last update stamp %llu %llu\n", hm.ent[hm.num-1].tsec, hm.ent[hm.num-1].tnsec);
+	if (created)
+		recreated++;
+
+	dnet_conv_log(DNET_CONV_LOG_KEY, "Processing key %.128s  %sok. Last update stamp %llu %llu\n",
+			dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), created ? "not found, metadata re-created, " : "",
+			(unsigned long long)hm.ent[hm.num-1].tsec, (unsigned long long)hm.ent[hm.num-1].tnsec);
 
-err_out_free:
-	free(mc.data);
 err_out_exit:
 	counter++;
-	if (!(counter % 10000)) {
-		t = time(NULL);
-		tm = localtime(&t);
-		strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
-		fprintf(stderr, "%s: %llu/%llu records processed\n", tstr, counter, total);
+}
+
+static const char *hparser_visit(const char *key, size_t keysz,
+			const char *hdata, size_t datasz, size_t *sp __attribute((unused)), void *opq)
+{
+	struct db_ptrs *ptrs = opq;
+	struct dnet_raw_id id;
+	void *rdata = NULL;
+	uint64_t start;
+	int err = -EINVAL;
+
+	if (keysz == DNET_ID_SIZE) {
+		memcpy(id.id, key, DNET_ID_SIZE);
+
+		start = dnet_conv_stat_start();
+
+		/* only keys present in the index are worth reading */
+		if (ptrs->index && !dnet_meta_index_exists(ptrs->index, id.id))
+			err = -ENOENT;
+		else if (dry_run)
+			err = dnet_meta_index_lookup(ptrs->index, id.id, &ptrs->read_arena);
+		else
+			err = dnet_db_read_raw(ptrs->newmeta, &id, &rdata);
+
+		dnet_conv_stat_end(DNET_CONV_STAT_META_READ, start);
 	}
 
+	if (dry_run) {
+		hparser_process(ptrs, key, keysz, hdata, datasz, err > 0 ? ptrs->read_arena.data : NULL, err);
+		return KCVISNOP;
+	}
+
+	hparser_process(ptrs, key, keysz, hdata, datasz, rdata, err);
+	free(rdata);
+
 	return KCVISNOP;
 }
 
+/* kccurget() timed as source read */
+static char *hparser_next(KCCUR *cur, size_t *ksiz, const char **vbuf, size_t *vsiz)
+{
+	uint64_t start = dnet_conv_stat_start();
+	char *kbuf;
+
+	kbuf = kccurget(cur, ksiz, vbuf, vsiz, 1);
+	dnet_conv_stat_end(DNET_CONV_STAT_SOURCE_READ, start);
+	return kbuf;
+}
+
+static int hparser_join_cmp(const void *p1, const void *p2)
+{
+	const struct hparser_join *j1 = *(const struct hparser_join **)p1;
+	const struct hparser_join *j2 = *(const struct hparser_join **)p2;
+
+	if (j1->loc != j2->loc)
+		return j1->loc < j2->loc ? -1 : 1;
+	return 0;
+}
+
+static void hparser_join_process(struct db_ptrs *ptrs, struct hparser_join *j)
+{
+	struct dnet_meta_index *idx = ptrs->index;
+	unsigned char *id = (unsigned char *)j->data;
+	uint64_t prefix, i, start;
+	int err = -EINVAL;
+
+	if (j->keysz == DNET_ID_SIZE) {
+		err = -ENOENT;
+		prefix = dnet_meta_index_prefix(id);
+		start = dnet_conv_stat_start();
+
+		/* fingerprints may collide, full key is checked on read */
+		for (i = j->first; i < idx->num && idx->ent[i].prefix == prefix; ++i) {
+			err = dnet_meta_index_read(idx, idx->ent[i].loc, id, &ptrs->read_arena);
+			if (err != -ENOENT)
+				break;
+		}
+
+		dnet_conv_stat_end(DNET_CONV_STAT_META_READ, start);
+	}
+
+	hparser_process(ptrs, j->data, j->keysz, j->data + j->keysz, j->datasz,
+			err > 0 ? ptrs->read_arena.data : NULL, err);
+}
+
+/*
+ * Joined records are processed in blob order, so meta reads within
+ * window go forward through the blob instead of seeking around.
+ */
+static void hparser_join_flush(struct db_ptrs *ptrs)
+{
+	int i;
+
+	qsort(ptrs->window, ptrs->window_num, sizeof(struct hparser_join *), hparser_join_cmp);
+
+	for (i = 0; i < ptrs->window_num; ++i) {
+		hparser_join_process(ptrs, ptrs->window[i]);
+		free(ptrs->window[i]);
+	}
+
+	ptrs->window_num = 0;
+}
+
+/*
+ * Merge-join needs keys in order, which only tree databases (file and
+ * in-memory B+ tree, forest) keep. Type is read from kcdbstatus().
+ */
+static int hparser_ordered(KCDB *history)
+{
+	char *status, *p;
+	unsigned int type = 0;
+
+	status = kcdbstatus(history);
+	if (!status)
+		return 0;
+
+	/* "name\tvalue" lines, "realtype" must not match */
+	p = status;
+	if (strncmp(p, "type\t", 5)) {
+		p = strstr(status, "\ntype\t");
+		if (p)
+			p++;
+	}
+	if (p)
+		type = strtoul(p + 5, NULL, 10);
+	kcfree(status);
+
+	switch (type) {
+		case 0x11:	/* prototype tree */
+		case 0x21:	/* cache tree */
+		case 0x31:	/* file tree */
+		case 0x41:	/* directory tree */
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Merge-join of key ordered history with sorted meta index: both are
+ * walked forward only, no per-key eblob lookups. Returns negative error
+ * code on failure, -EINVAL if history turns out not to be ordered.
+ */
+static int hparser_merge(KCDB *history, struct db_ptrs *ptrs, struct dnet_checkpoint *c,
+		struct dnet_checkpoint_data *resume)
+{
+	struct dnet_meta_index *idx = ptrs->index;
+	struct hparser_join *j;
+	unsigned char prev[DNET_ID_SIZE];
+	uint64_t pos = 0, prefix = 0;
+	int have_prev = 0;
+	const char *vbuf;
+	char *kbuf;
+	size_t ksiz, vsiz;
+	KCCUR *cur;
+	int err = 0;
+
+	cur = kcdbcursor(history);
+
+	if (resume) {
+		err = kccurjumpkey(cur, resume->pos, resume->pos_size);
+		if (resume->pos_size == DNET_ID_SIZE)
+			pos = dnet_meta_index_lower_bound(idx, dnet_meta_index_prefix((unsigned char *)resume->pos));
+	} else {
+		err = kccurjump(cur);
+	}
+	if (!err) {
+		err = kccurecode(cur) == KCENOREC ? 0 : -kccurecode(cur);
+		goto err_out_free;
+	}
+
+	err = 0;
+	while ((kbuf = hparser_next(cur, &ksiz, &vbuf, &vsiz)) != NULL) {
+		if (ksiz == DNET_ID_SIZE) {
+			if (have_prev && memcmp(prev, kbuf, DNET_ID_SIZE) > 0) {
+				dnet_conv_log(DNET_CONV_LOG_ERROR, "History database is not ordered by key, "
+						"merge-join requires tree database (.kct).\n");
+				kcfree(kbuf);
+				err = -EINVAL;
+				break;
+			}
+
+			memcpy(prev, kbuf, DNET_ID_SIZE);
+			have_prev = 1;
+
+			prefix = dnet_meta_index_prefix((unsigned char *)kbuf);
+			while (pos < idx->num && idx->ent[pos].prefix < prefix)
+				pos++;
+		}
+
+		if (!dnet_shard_match(&shard, kbuf, ksiz)) {
+			kcfree(kbuf);
+			continue;
+		}
+
+		if (ptrs->window_num == HPARSER_JOIN_WINDOW) {
+			hparser_join_flush(ptrs);
+
+			/* everything before current key is processed now */
+			if (c) {
+				dnet_checkpoint_poll(c, 1);
+				if (dnet_checkpoint_need(c))
+					dnet_checkpoint_take(c, kbuf, ksiz, counter);
+			}
+		}
+
+		j = malloc(sizeof(struct hparser_join) + ksiz + vsiz);
+		if (!j) {
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Failed to allocate join record for %zu bytes\n", ksiz + vsiz);
+			kcfree(kbuf);
+			err = -ENOMEM;
+			break;
+		}
+
+		j->keysz = ksiz;
+		j->datasz = vsiz;
+		j->first = pos;
+		j->loc = UINT64_MAX;
+		if (ksiz == DNET_ID_SIZE && pos < idx->num && idx->ent[pos].prefix == prefix)
+			j->loc = idx->ent[pos].loc;
+
+		memcpy(j->data, kbuf, ksiz);
+		memcpy(j->data + ksiz, vbuf, vsiz);
+		ptrs->window[ptrs->window_num++] = j;
+
+		kcfree(kbuf);
+	}
+
+	if (!err && kccurecode(cur) != KCENOREC)
+		err = -kccurecode(cur);
+
+	hparser_join_flush(ptrs);
+
+err_out_free:
+	kccurdel(cur);
+	return err;
+}
+
+/*
+ * Walks history database with a cursor so iteration can start from the key
+ * saved in checkpoint. Returns negative KC error code on failure.
+ */
+static int hparser_iterate(KCDB *history, struct db_ptrs *ptrs, struct dnet_checkpoint *c,
+		struct dnet_checkpoint_data *resume)
+{
+	const char *vbuf;
+	char *kbuf;
+	size_t ksiz, vsiz;
+	KCCUR *cur;
+	int err = 0;
+
+	cur = kcdbcursor(history);
+
+	if (resume)
+		err = kccurjumpkey(cur, resume->pos, resume->pos_size);
+	else
+		err = kccurjump(cur);
+	if (!err) {
+		err = kccurecode(cur) == KCENOREC ? 0 : -kccurecode(cur);
+		goto err_out_free;
+	}
+
+	while ((kbuf = hparser_next(cur, &ksiz, &vbuf, &vsiz)) != NULL) {
+		if (!dnet_shard_match(&shard, kbuf, ksiz)) {
+			kcfree(kbuf);
+			continue;
+		}
+
+		if (c && !(counter % DNET_CHECKPOINT_BATCH)) {
+			dnet_checkpoint_poll(c, 1);
+			if (dnet_checkpoint_need(c))
+				dnet_checkpoint_take(c, kbuf, ksiz, counter);
+		}
+
+		hparser_visit(kbuf, ksiz, vbuf, vsiz, NULL, ptrs);
+		kcfree(kbuf);
+	}
+
+	err = kccurecode(cur) == KCENOREC ? 0 : -kccurecode(cur);
+
+err_out_free:
+	kccurdel(cur);
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	int err, ch;
@@ -194,10 +528,19 @@ int main(int argc, char *argv[])
 	time_t t;
 	struct tm *tm;
 	struct db_ptrs ptrs;
+	struct dnet_checkpoint ckpt, *c = NULL;
+	struct dnet_meta_index index;
+	int merge = 0;
+	int use_index = 0;
+	struct dnet_checkpoint_data resume_data, *resume_pos = NULL;
+	char ckpt_path[PATH_MAX];
+	int resume = 0;
+	int log_level = DNET_CONV_LOG_KEY;
+	char *stats_name = NULL;
 
 	size = offset = 0;
 
-	while ((ch = getopt(argc, argv, "M:H:g:h")) != -1) {
+	while ((ch = getopt(argc, argv, "M:H:g:Ss:Inrv:t:w:h")) != -1) {
 		switch (ch) {
 			case 'M':
 				newmeta_name = optarg;
@@ -208,6 +551,32 @@ int main(int argc, char *argv[])
 			case 'g':
 				group_num = dnet_parse_groups(optarg, &groups);
 				break;
+			case 'S':
+				merge = 1;
+				break;
+			case 'I':
+				use_index = 1;
+				break;
+			case 's':
+				if (dnet_parse_shard(optarg, &shard))
+					hparser_usage(argv[0]);
+				break;
+			case 'n':
+				dry_run = 1;
+				break;
+			case 'w':
+				if (dnet_parse_write_rate(optarg))
+					hparser_usage(argv[0]);
+				break;
+			case 'r':
+				resume = 1;
+				break;
+			case 'v':
+				log_level = atoi(optarg);
+				break;
+			case 't':
+				stats_name = optarg;
+				break;
 			case 'h':
 				hparser_usage(argv[0]);
 				break;
@@ -224,7 +593,41 @@ int main(int argc, char *argv[])
 		hparser_usage(argv[0]);
 	}
 
+	if (dry_run && resume) {
+		fprintf(stderr, "Dry run can not be combined with resume.\n");
+		hparser_usage(argv[0]);
+	}
+
+	/* dry run never opens meta blob, records are read through its index */
+	if (dry_run)
+		use_index = 1;
+
 	memset(&ptrs, 0, sizeof(struct db_ptrs));
+	snprintf(ckpt_path, sizeof(ckpt_path), "%s.history.checkpoint", newmeta_name);
+
+	if (resume) {
+		err = dnet_checkpoint_load(ckpt_path, &resume_data);
+		if (err)
+			goto err_out_exit;
+
+		resume_pos = &resume_data;
+		counter = resume_data.processed;
+		fprintf(stderr, "Resuming after %llu processed records\n", (unsigned long long)counter);
+	}
+
+	if (stats_name) {
+		err = dnet_conv_stat_init(stats_name);
+		if (err) {
+			fprintf(stderr, "Failed to enable stats: %d.\n", err);
+			goto err_out_exit;
+		}
+	}
+
+	err = dnet_conv_log_init(log_level, DNET_CONV_PROGRESS_INTERVAL);
+	if (err) {
+		fprintf(stderr, "Failed to start logger: %d.\n", err);
+		goto err_out_exit;
+	}
 
 	printf("opening %s history database\n", history_name);
 	history = kcdbnew();
@@ -234,50 +637,114 @@ int main(int argc, char *argv[])
 		goto err_out_exit;
 	}
 
+	/* checked up front, windows flushed before an out of order key is seen can not be undone */
+	if (merge && !hparser_ordered(history)) {
+		fprintf(stderr, "History database '%s' is not a tree database, -S requires ordered keys (.kct).\n",
+				history_name);
+		err = -EINVAL;
+		goto err_out_dbopen;
+	}
+
+	if (merge || use_index) {
+		printf("building %s meta index\n", newmeta_name);
+
+		err = dnet_meta_index_build(&index, newmeta_name);
+		if (err)
+			goto err_out_dbopen;
+
+		ptrs.index = &index;
+		printf("meta index holds %llu records\n", (unsigned long long)index.num);
+	}
+
 	memset(&ecfg, 0, sizeof(ecfg));
 	ecfg.file = newmeta_name;
 	ecfg.sync = 30;
 
-	log.log = dnet_common_log;
-	log.log_private = NULL;
-	log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
-	ecfg.log = &log;
+	if (!dry_run) {
+		log.log = dnet_common_log;
+		log.log_private = NULL;
+		log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
+		ecfg.log = &log;
 
-	newmeta = eblob_init(&ecfg);
-	if (!newmeta) {
-		fprintf(stderr, "Failed to open meta database '%s'.\n", newmeta_name);
-		goto err_out_dbopen;
+		newmeta = eblob_init(&ecfg);
+		if (!newmeta) {
+			fprintf(stderr, "Failed to open meta database '%s'.\n", newmeta_name);
+			goto err_out_dbopen;
+		}
+
+		ptrs.newmeta = newmeta;
 	}
 
-	ptrs.newmeta = newmeta;
+	err = dnet_meta_writer_start(&ptrs.writer, newmeta, NULL, DNET_META_WRITER_QUEUE_SIZE);
+	if (err) {
+		fprintf(stderr, "Failed to start meta writer: %d.\n", err);
+		goto err_out_dbopen2;
+	}
 
 	t = time(NULL);
 	tm = localtime(&t);
 	strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
 	total = (unsigned long long)kcdbcount(history);
 	fprintf(stderr, "%s: Total %llu records in history DB\n", tstr, total);
+	if (shard.num > 1)
+		total /= shard.num;
 
-	err = kcdbiterate(history, hparser_visit, &ptrs, 0);
-	if (!err) {
-		fprintf(stderr, "Failed to iterate history database '%s': %d.\n", history_name, -kcdbecode(history));
+	if (!dry_run) {
+		err = dnet_checkpoint_init(&ckpt, ckpt_path, &ptrs.writer, ecfg.sync + 1);
+		if (err)
+			goto err_out_stop_writer;
+
+		c = &ckpt;
+	}
+
+	dnet_conv_progress_start(hparser_processed, &ptrs, total);
+
+	if (merge)
+		err = hparser_merge(history, &ptrs, c, resume_pos);
+	else
+		err = hparser_iterate(history, &ptrs, c, resume_pos);
+	if (err) {
+		fprintf(stderr, "Failed to iterate history database '%s': %d.\n", history_name, err);
 	}
 
+	dnet_meta_writer_stop(&ptrs.writer);
+	dnet_conv_progress_stop();
+	dnet_meta_arena_destroy(&ptrs.arena);
+	dnet_meta_arena_destroy(&ptrs.read_arena);
+	if (c)
+		dnet_checkpoint_cleanup(c, !err);
+
 	t = time(NULL);
 	tm = localtime(&t);
 	strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
 	total = (unsigned long long)kcdbcount(history);
-	fprintf(stderr, "%s: Totally processed %llu records from history DB\n", tstr, counter);
+	fprintf(stderr, "%s: Totally processed %llu records from history DB, written: %llu, write errors: %llu\n",
+			tstr, counter, (unsigned long long)ptrs.writer.written,
+			(unsigned long long)ptrs.writer.errors);
+
+	if (dry_run)
+		dnet_meta_writer_report(&ptrs.writer, counter, recreated, shard.num > 1 ? total / shard.num : total);
+
+	goto err_out_dbopen2;
 
+err_out_stop_writer:
+	dnet_meta_writer_stop(&ptrs.writer);
 err_out_dbopen2:
-	eblob_cleanup(newmeta);
+	if (newmeta)
+		eblob_cleanup(newmeta);
 
 err_out_dbopen:
-	err = kcdbclose(history);
-	if (!err)
+	if (ptrs.index)
+		dnet_meta_index_destroy(ptrs.index);
+
+	if (!kcdbclose(history)) {
 		fprintf(stderr, "Failed to close history database '%s': %d.\n", history_name, -kcdbecode(history));
+		if (!err)
+			err = 1;
+	}
 	kcdbdel(history);
-	err = !err;
 
 err_out_exit:
+	dnet_conv_log_exit();
 	return err;
 }
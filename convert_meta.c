@@ -23,11 +23,14 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <kclangc.h>
 
 #include <elliptics/packet.h>
@@ -42,147 +45,519 @@ static void mparser_usage(const char *p)
 	fprintf(stderr, " -M                   - meta database to parse\n"
 			" -N                   - new meta database (blob)\n"
 			" -g                   - default groups for objects without groups in meta\n"
+			" -H, --history        - history database to merge in the same pass\n"
+			" -j                   - number of worker threads (default 1)\n"
+			" -v                   - verbosity: 0 - errors only, 1 - progress and totals, 2 - every key (default)\n"
+			" -t, --stats file     - dump per-phase latency histograms as JSON into file\n"
+			" -B, --bulk-load      - new meta blob is empty: skip lookups and write it sequentially\n"
+			" -r, --resume         - continue from the last checkpoint of interrupted run\n"
+			" -s, --shard i/N      - process only keys of shard i out of N\n"
+			" -I, --index          - load index of new meta blob and check existing keys in memory\n"
+			" -n, --dry-run        - only count what would be written, new meta blob is not opened\n"
+			" -w, --write-rate R[:MB] - eblob write rate assumed by dry run estimate, records/s and MB/s\n"
 			" -h                   - this help\n");
 	exit(-1);
 }
 
+#define MPARSER_QUEUE_SIZE	1024
+
 uint64_t counter = 0;
+uint64_t resumed = 0;
+/* history keys found in meta, never given to workers */
+uint64_t skipped = 0;
 uint64_t total = 0;
 
 int *groups = NULL;
 int group_num = 0;
+struct dnet_shard shard;
+
+/*
+ * Each worker owns a disjoint range of the shard's ID space (split on the
+ * leading 8 bytes of the key) and gets records of that range through its
+ * queue.
+ */
+struct mparser_worker {
+	pthread_t		tid;
+	struct dnet_job_queue	queue;
+	struct db_ptrs		*ptrs;
+	struct dnet_meta_arena	arena;
+	uint64_t		counter;
+
+	/* jobs pushed into the queue and their number at pending checkpoint */
+	uint64_t		dispatched;
+	uint64_t		mark;
+};
+
+struct mparser_job {
+	size_t			keysz;
+	size_t			datasz;
+	size_t			hsz;
+	char			data[0];
+};
 
 struct db_ptrs {
+	KCDB			*meta;
+	KCDB			*history;
 	struct eblob_backend *newmeta;
+	struct dnet_meta_writer	writer;
+	struct dnet_bulk_blob	*bulk;
+	struct dnet_meta_arena	arena;
+	struct dnet_meta_index	*index;
+
+	struct mparser_worker	*workers;
+	int			worker_num;
 };
 
-static const char *mparser_visit(const char *key, size_t keysz,
-			const char *mdata, size_t datasz, size_t *sp __attribute((unused)), void *opq)
+/*
+ * Applies what history converter would have patched in later:
+ * timestamp and removal flag of the last history entry. The record is
+ * read from history database unless caller already has it in @hdata.
+ */
+static int mparser_apply_history(struct db_ptrs *ptrs, const char *key, size_t keysz,
+		const char *hdata, size_t hsz, struct dnet_meta_create_control *ctl)
+{
+	char id_str[2 * DNET_ID_SIZE + 1];
+	struct dnet_history_entry e;
+	uint64_t start;
+	char *record = NULL;
+	int err = 0;
+
+	if (!hdata) {
+		start = dnet_conv_stat_start();
+		record = kcdbget(ptrs->history, key, keysz, &hsz);
+		dnet_conv_stat_end(DNET_CONV_STAT_SOURCE_READ, start);
+		if (!record) {
+			err = -ENOENT;
+			goto err_out_exit;
+		}
+		hdata = record;
+	}
+
+	if (!hsz || hsz % sizeof(struct dnet_history_entry)) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  Corrupted history record, "
+				"its size %zu must be multiple of %zu.\n",
+				dnet_dump_id_len_raw((unsigned char *)key, DNET_ID_SIZE, id_str),
+				hsz, sizeof(struct dnet_history_entry));
+		err = -EINVAL;
+		goto err_out_free;
+	}
+
+	memcpy(&e, hdata + hsz - sizeof(struct dnet_history_entry), sizeof(struct dnet_history_entry));
+	dnet_convert_history_entry(&e);
+
+	ctl->update_ts.tv_sec = e.tsec;
+	ctl->update_ts.tv_nsec = e.tnsec;
+	ctl->update_flags = e.flags & DNET_IO_FLAGS_REMOVED;
+
+err_out_free:
+	if (record)
+		kcfree(record);
+err_out_exit:
+	return err;
+}
+
+static void mparser_process(struct db_ptrs *ptrs, struct dnet_meta_arena *arena,
+			const char *key, size_t keysz, const char *mdata, size_t datasz,
+			const char *hdata, size_t hsz)
 {
-	struct db_ptrs *ptrs = opq;
 	char id_str[2 * DNET_ID_SIZE + 1];
 	struct dnet_raw_id id;
 	struct dnet_meta_container mc;
 	struct dnet_meta_create_control ctl;
-	struct dnet_meta m, *mp = NULL;
-	struct dnet_meta_update *mu;
+	struct dnet_meta_view view;
+	struct dnet_meta_update *mu, update;
 	struct dnet_meta_checksum *csum;
-	void *data = (void *)mdata;
-	unsigned int size = datasz;
-	char tstr[64];
-	time_t t;
-	struct tm *tm;
+	uint64_t start;
 	int err = 0;
 
 	if (keysz != DNET_ID_SIZE) {
-		fprintf(stdout, "Incorrect key size\n");
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Incorrect key size\n");
 		goto err_out_exit;
 	}
 
 	memcpy(id.id, key, DNET_ID_SIZE);
-	dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str);
-	
-	fprintf(stdout, "Processing key %.128s  ", id_str);
 
 	memset(&ctl, 0, sizeof(ctl));
 	dnet_setup_id(&ctl.id, 0, id.id);
 
-	err = dnet_db_read_raw(ptrs->newmeta, &id, &mc.data);
+	mc.data = NULL;
+	start = dnet_conv_stat_start();
+	if (ptrs->bulk)
+		err = -ENOENT;
+	else if (ptrs->index)
+		err = dnet_meta_index_exists(ptrs->index, id.id) ? 1 : -ENOENT;
+	else
+		err = dnet_db_read_raw(ptrs->newmeta, &id, &mc.data);
+	dnet_conv_stat_end(DNET_CONV_STAT_META_READ, start);
 	if (err != -ENOENT) {
 		if (err > 0) {
-			fprintf(stdout, "failed. Record with this ID already exists. Skipping.\n");
+			dnet_conv_log(DNET_CONV_LOG_KEY, "Processing key %.128s  failed. "
+					"Record with this ID already exists. Skipping.\n", dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
 			goto err_out_free;
 		} else {
-			fprintf(stdout, "failed. Unable to read new meta, err %d\n", err);
+			dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed. "
+					"Unable to read new meta, err %d\n",
+					dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), err);
 			goto err_out_exit;
 		}
 	}
 
-	while (size) {
-		if (size < sizeof(struct dnet_meta)) {
-			fprintf(stdout, "failed. Metadata size %u is too small, min %zu.\n",
-					size, sizeof(struct dnet_meta));
-			err = -1;
-			goto err_out_exit;
-			break;
-		}
+	start = dnet_conv_stat_start();
 
-		mp = data;
-		m = *(struct dnet_meta *)data;
-		dnet_convert_meta(&m);
+	/* old parser overwrote fields on every entry, so the last one wins */
+	err = dnet_meta_view_init(&view, (void *)mdata, datasz, DNET_META_VIEW_LAST);
+	if (err) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed. Metadata is broken.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
+		goto err_out_exit;
+	}
 
-		if (m.size + sizeof(struct dnet_meta) > size) {
-			fprintf(stdout , "failed. Metadata entry broken: entry size %u, type: 0x%x, struct size: %zu, "
-					"total size left: %u.\n",
-					m.size, m.type, sizeof(struct dnet_meta), size);
-			err = -1;
-			goto err_out_exit;
-			break;
-		}
+	ctl.obj = dnet_meta_view_parent(&view, &ctl.len);
+	ctl.groups = dnet_meta_view_groups(&view, &ctl.group_num);
 
-		switch (m.type) {
-			case DNET_META_PARENT_OBJECT:
-				ctl.obj = mp->data;
-				ctl.len = m.size;
-				break;
+	csum = dnet_meta_view_checksum(&view);
+	if (csum)
+		memcpy(ctl.checksum, csum->checksum, DNET_CSUM_SIZE);
 
-			case DNET_META_GROUPS:
-				ctl.groups = (int *)mp->data;
-				ctl.group_num = m.size / sizeof(int);
-				break;
+	/* source record is left intact, only the timestamp is converted */
+	mu = dnet_meta_view_update(&view);
+	if (mu) {
+		update = *mu;
+		dnet_convert_meta_update(&update);
+		ctl.ts.tv_sec = update.tm.tsec;
+		ctl.ts.tv_nsec = update.tm.tnsec;
+	}
 
-			case DNET_META_CHECKSUM:
-				csum = (struct dnet_meta_checksum *)mp->data;
-				memcpy(ctl.checksum, csum->checksum, DNET_CSUM_SIZE);
-				break;
+	if (!ctl.groups) {
+		ctl.groups = groups;
+		ctl.group_num = group_num;
+	}
 
-			case DNET_META_UPDATE:
-				mu = (struct dnet_meta_update *)mp->data;
-				dnet_convert_meta_update(mu);
-				ctl.ts.tv_sec = mu->tm.tsec;
-				ctl.ts.tv_nsec = mu->tm.tnsec;
-		}
+	if (ptrs->history)
+		mparser_apply_history(ptrs, key, keysz, hdata, hsz, &ctl);
 
-		data += m.size + sizeof(struct dnet_meta);
-		size -= m.size + sizeof(struct dnet_meta);
+	mc.data = dnet_meta_arena_reserve(arena, dnet_create_meta_size(&ctl));
+	if (!mc.data) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed to allocate new meta.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
+		goto err_out_exit;
 	}
 
-	err = dnet_create_write_meta(&ctl, &mc.data);
+	err = dnet_create_write_meta_buf(&ctl, mc.data, arena->size);
+	dnet_conv_stat_end(DNET_CONV_STAT_META_BUILD, start);
 	if (err <= 0) {
-		fprintf(stdout, "failed to create new meta, err %d.\n", err);
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed to create new meta, err %d.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), err);
 		goto err_out_exit;
 	}
 
 	mc.size = err;
 
-	err = dnet_db_write_raw(ptrs->newmeta, &id, mc.data, mc.size);
+	err = dnet_meta_writer_queue(&ptrs->writer, &id, mc.data, mc.size);
 	if (err) {
-		fprintf(stdout, "failed to write new meta, err %d.\n", err);
-		goto err_out_free;
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Processing key %.128s  failed to queue new meta, err %d.\n",
+				dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str), err);
+		goto err_out_exit;
 	}
 
-	fprintf(stdout, "ok.\n");
+	dnet_conv_log(DNET_CONV_LOG_KEY, "Processing key %.128s  ok.\n",
+			dnet_dump_id_len_raw(id.id, DNET_ID_SIZE, id_str));
+	return;
 
 err_out_free:
 	free(mc.data);
+err_out_exit:
+	return;
+}
+
+static uint64_t mparser_processed(void *priv)
+{
+	struct db_ptrs *ptrs = priv;
+	uint64_t processed = 0;
+	int i;
+
+	if (!ptrs->worker_num)
+		return counter;
+
+	for (i = 0; i < ptrs->worker_num; ++i)
+		processed += __atomic_load_n(&ptrs->workers[i].counter, __ATOMIC_ACQUIRE);
+
+	return resumed + __atomic_load_n(&skipped, __ATOMIC_ACQUIRE) + processed;
+}
+
+static void mparser_process_inline(struct db_ptrs *ptrs, const char *key, size_t keysz,
+			const char *mdata, size_t datasz, const char *hdata, size_t hsz)
+{
+	mparser_process(ptrs, &ptrs->arena, key, keysz, mdata, datasz, hdata, hsz);
+	counter++;
+}
+
+static const char *mparser_visit(const char *key, size_t keysz,
+			const char *mdata, size_t datasz, size_t *sp __attribute((unused)), void *opq)
+{
+	mparser_process_inline(opq, key, keysz, mdata, datasz, NULL, 0);
+
+	return KCVISNOP;
+}
+
+static void *mparser_worker_process(void *data)
+{
+	struct mparser_worker *w = data;
+	struct mparser_job *job;
+
+	while ((job = dnet_job_queue_pop(&w->queue)) != NULL) {
+		mparser_process(w->ptrs, &w->arena, job->data, job->keysz,
+				job->data + job->keysz, job->datasz,
+				job->hsz ? job->data + job->keysz + job->datasz : NULL, job->hsz);
+		free(job);
+
+		__atomic_store_n(&w->counter, w->counter + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Used with -j: copies record (and history record if caller has one) and
+ * hands it to the worker owning the key range, so KC iteration does not
+ * wait for eblob I/O.
+ */
+static void mparser_queue(struct db_ptrs *ptrs, const char *key, size_t keysz,
+			const char *mdata, size_t datasz, const char *hdata, size_t hsz)
+{
+	struct mparser_worker *w;
+	struct mparser_job *job;
+	int err;
+
+	job = malloc(sizeof(struct mparser_job) + keysz + datasz + hsz);
+	if (!job) {
+		dnet_conv_log(DNET_CONV_LOG_ERROR, "Failed to allocate job for %zu bytes record\n",
+				keysz + datasz + hsz);
+		goto err_out_exit;
+	}
+
+	job->keysz = keysz;
+	job->datasz = datasz;
+	job->hsz = hsz;
+	memcpy(job->data, key, keysz);
+	memcpy(job->data + keysz, mdata, datasz);
+	memcpy(job->data + keysz + datasz, hdata, hsz);
+
+	w = &ptrs->workers[dnet_shard_slot(&shard, key, keysz, ptrs->worker_num)];
+
+	err = dnet_job_queue_push(&w->queue, job);
+	if (err)
+		free(job);
+	else
+		w->dispatched++;
+
 err_out_exit:
 	counter++;
-	if (!(counter % 10000)) {
-		t = time(NULL);
-		tm = localtime(&t);
-		strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
-		fprintf(stderr, "%s: %llu/%llu records processed\n", tstr, counter, total);
+}
+
+static const char *mparser_dispatch(const char *key, size_t keysz,
+			const char *mdata, size_t datasz, size_t *sp __attribute((unused)), void *opq)
+{
+	mparser_queue(opq, key, keysz, mdata, datasz, NULL, 0);
+
+	return KCVISNOP;
+}
+
+/*
+ * Second pass of fused conversion: keys that only exist in history are
+ * created with default groups, the rest was handled in meta pass.
+ */
+static const char *mparser_history_visit(const char *key, size_t keysz,
+			const char *hdata, size_t hsz, size_t *sp __attribute((unused)), void *opq)
+{
+	struct db_ptrs *ptrs = opq;
+	uint64_t start = dnet_conv_stat_start();
+	char tmp;
+	int err;
+
+	err = kcdbgetbuf(ptrs->meta, key, keysz, &tmp, sizeof(tmp));
+	dnet_conv_stat_end(DNET_CONV_STAT_SOURCE_READ, start);
+	if (err >= 0) {
+		__atomic_add_fetch(&skipped, 1, __ATOMIC_RELEASE);
+		counter++;
+		return KCVISNOP;
 	}
 
+	if (ptrs->worker_num)
+		mparser_queue(ptrs, key, keysz, NULL, 0, hdata, hsz);
+	else
+		mparser_process_inline(ptrs, key, keysz, NULL, 0, hdata, hsz);
+
 	return KCVISNOP;
 }
 
+static int mparser_start_workers(struct db_ptrs *ptrs, int num)
+{
+	struct mparser_worker *w;
+	int err, i;
+
+	ptrs->workers = calloc(num, sizeof(struct mparser_worker));
+	if (!ptrs->workers)
+		return -ENOMEM;
+
+	for (i = 0; i < num; ++i) {
+		w = &ptrs->workers[i];
+		w->ptrs = ptrs;
+
+		err = dnet_job_queue_init(&w->queue, MPARSER_QUEUE_SIZE);
+		if (err)
+			goto err_out_stop;
+
+		err = -pthread_create(&w->tid, NULL, mparser_worker_process, w);
+		if (err) {
+			dnet_job_queue_destroy(&w->queue);
+			goto err_out_stop;
+		}
+
+		ptrs->worker_num++;
+	}
+
+	return 0;
+
+err_out_stop:
+	fprintf(stderr, "Failed to start worker %d: %d.\n", i, err);
+	return err;
+}
+
+static void mparser_stop_workers(struct db_ptrs *ptrs)
+{
+	int i;
+
+	for (i = 0; i < ptrs->worker_num; ++i)
+		dnet_job_queue_close(&ptrs->workers[i].queue);
+
+	for (i = 0; i < ptrs->worker_num; ++i) {
+		pthread_join(ptrs->workers[i].tid, NULL);
+		dnet_job_queue_destroy(&ptrs->workers[i].queue);
+		dnet_meta_arena_destroy(&ptrs->workers[i].arena);
+	}
+
+	counter = mparser_processed(ptrs);
+
+	free(ptrs->workers);
+	ptrs->workers = NULL;
+	ptrs->worker_num = 0;
+}
+
+/*
+ * Pending checkpoint at @key moves on once every worker has processed
+ * the jobs it had been given before @key was reached.
+ */
+static void mparser_checkpoint(struct db_ptrs *ptrs, struct dnet_checkpoint *c, int pass,
+		const char *key, size_t keysz)
+{
+	char pos[DNET_CHECKPOINT_POS_SIZE];
+	struct mparser_worker *w;
+	int done = 1;
+	int i;
+
+	for (i = 0; i < ptrs->worker_num; ++i) {
+		w = &ptrs->workers[i];
+
+		if (__atomic_load_n(&w->counter, __ATOMIC_ACQUIRE) < w->mark)
+			done = 0;
+	}
+
+	dnet_checkpoint_poll(c, done);
+
+	if (dnet_checkpoint_need(c)) {
+		for (i = 0; i < ptrs->worker_num; ++i)
+			ptrs->workers[i].mark = ptrs->workers[i].dispatched;
+
+		/* position is pass number followed by the key */
+		if (keysz + 1 > sizeof(pos))
+			return;
+
+		pos[0] = pass;
+		memcpy(pos + 1, key, keysz);
+		dnet_checkpoint_take(c, pos, keysz + 1, counter);
+	}
+}
+
+/* kccurget() timed as source read */
+static char *mparser_next(KCCUR *cur, size_t *ksiz, const char **vbuf, size_t *vsiz)
+{
+	uint64_t start = dnet_conv_stat_start();
+	char *kbuf;
+
+	kbuf = kccurget(cur, ksiz, vbuf, vsiz, 1);
+	dnet_conv_stat_end(DNET_CONV_STAT_SOURCE_READ, start);
+	return kbuf;
+}
+
+/*
+ * Walks database with a cursor so iteration can start from the key
+ * saved in checkpoint. Returns negative KC error code on failure.
+ */
+static int mparser_iterate(KCDB *db, KCVISITFULL visit, struct db_ptrs *ptrs, struct dnet_checkpoint *c,
+		int pass, const char *resume_key, size_t resume_size)
+{
+	const char *vbuf;
+	char *kbuf;
+	size_t ksiz, vsiz;
+	KCCUR *cur;
+	int err = 0;
+
+	cur = kcdbcursor(db);
+
+	if (resume_key)
+		err = kccurjumpkey(cur, resume_key, resume_size);
+	else
+		err = kccurjump(cur);
+	if (!err) {
+		err = kccurecode(cur) == KCENOREC ? 0 : -kccurecode(cur);
+		goto err_out_free;
+	}
+
+	while ((kbuf = mparser_next(cur, &ksiz, &vbuf, &vsiz)) != NULL) {
+		if (!dnet_shard_match(&shard, kbuf, ksiz)) {
+			kcfree(kbuf);
+			continue;
+		}
+
+		if (c && !(counter % DNET_CHECKPOINT_BATCH))
+			mparser_checkpoint(ptrs, c, pass, kbuf, ksiz);
+
+		visit(kbuf, ksiz, vbuf, vsiz, NULL, ptrs);
+		kcfree(kbuf);
+
+		/* failed bulk blob is discarded, there is no point to go on */
+		err = __atomic_load_n(&ptrs->writer.failed, __ATOMIC_ACQUIRE);
+		if (err)
+			goto err_out_free;
+	}
+
+	err = kccurecode(cur) == KCENOREC ? 0 : -kccurecode(cur);
+
+err_out_free:
+	kccurdel(cur);
+	return err;
+}
+
+static struct option mparser_options[] = {
+	{"bulk-load",	no_argument,	NULL,	'B'},
+	{"history",	required_argument,	NULL,	'H'},
+	{"resume",	no_argument,	NULL,	'r'},
+	{"shard",	required_argument,	NULL,	's'},
+	{"index",	no_argument,	NULL,	'I'},
+	{"dry-run",	no_argument,	NULL,	'n'},
+	{"write-rate",	required_argument,	NULL,	'w'},
+	{"stats",	required_argument,	NULL,	't'},
+	{"help",	no_argument,	NULL,	'h'},
+	{NULL,		0,		NULL,	0},
+};
+
 int main(int argc, char *argv[])
 {
 	int err, ch;
-	char *meta_name = NULL, *newmeta_name = NULL;
+	char *meta_name = NULL, *newmeta_name = NULL, *history_name = NULL;
 	unsigned long long offset, size;
-	KCDB *meta = NULL;
+	KCDB *meta = NULL, *history = NULL;
 	struct eblob_backend *newmeta = NULL;
 	struct eblob_config ecfg;
 	struct eblob_log log;
@@ -190,10 +565,26 @@ int main(int argc, char *argv[])
 	time_t t;
 	struct tm *tm;
 	struct db_ptrs ptrs;
+	struct dnet_bulk_blob bulk;
+	struct dnet_checkpoint ckpt, *c = NULL;
+	struct dnet_checkpoint_data resume_data;
+	const char *resume_key = NULL;
+	size_t resume_size = 0;
+	int resume_pass = 0;
+	char ckpt_path[PATH_MAX];
+	int thread_num = 1;
+	int bulk_load = 0;
+	int bulk_err = 0;
+	int use_index = 0;
+	int dry_run = 0;
+	struct dnet_meta_index index;
+	int resume = 0;
+	int log_level = DNET_CONV_LOG_KEY;
+	char *stats_name = NULL;
 
 	size = offset = 0;
 
-	while ((ch = getopt(argc, argv, "M:N:g:h")) != -1) {
+	while ((ch = getopt_long(argc, argv, "M:N:H:g:j:v:s:BInrt:w:h", mparser_options, NULL)) != -1) {
 		switch (ch) {
 			case 'M':
 				meta_name = optarg;
@@ -201,9 +592,41 @@ int main(int argc, char *argv[])
 			case 'N':
 				newmeta_name = optarg;
 				break;
+			case 'H':
+				history_name = optarg;
+				break;
 			case 'g':
 				group_num = dnet_parse_groups(optarg, &groups);
 				break;
+			case 'j':
+				thread_num = atoi(optarg);
+				break;
+			case 'B':
+				bulk_load = 1;
+				break;
+			case 'I':
+				use_index = 1;
+				break;
+			case 'n':
+				dry_run = 1;
+				break;
+			case 'r':
+				resume = 1;
+				break;
+			case 'v':
+				log_level = atoi(optarg);
+				break;
+			case 't':
+				stats_name = optarg;
+				break;
+			case 's':
+				if (dnet_parse_shard(optarg, &shard))
+					mparser_usage(argv[0]);
+				break;
+			case 'w':
+				if (dnet_parse_write_rate(optarg))
+					mparser_usage(argv[0]);
+				break;
 			case 'h':
 				mparser_usage(argv[0]);
 		}
@@ -219,7 +642,54 @@ int main(int argc, char *argv[])
 		mparser_usage(argv[0]);
 	}
 
+	if (bulk_load && resume) {
+		fprintf(stderr, "Bulk load can not be resumed, it requires empty target.\n");
+		mparser_usage(argv[0]);
+	}
+
+	if (dry_run && (bulk_load || resume)) {
+		fprintf(stderr, "Dry run can not be combined with bulk load or resume.\n");
+		mparser_usage(argv[0]);
+	}
+
+	/* dry run never opens new meta blob, existing keys are looked up in its index */
+	if (dry_run)
+		use_index = 1;
+
 	memset(&ptrs, 0, sizeof(struct db_ptrs));
+	snprintf(ckpt_path, sizeof(ckpt_path), "%s.meta.checkpoint", newmeta_name);
+
+	if (resume) {
+		err = dnet_checkpoint_load(ckpt_path, &resume_data);
+		if (err)
+			goto err_out_exit;
+
+		if (resume_data.pos_size < 2 || (resume_data.pos[0] && !history_name)) {
+			fprintf(stderr, "Checkpoint '%s' does not match given options.\n", ckpt_path);
+			err = -EINVAL;
+			goto err_out_exit;
+		}
+
+		resume_pass = resume_data.pos[0];
+		resume_key = resume_data.pos + 1;
+		resume_size = resume_data.pos_size - 1;
+		resumed = counter = resume_data.processed;
+		fprintf(stderr, "Resuming after %llu processed records\n", (unsigned long long)resumed);
+	}
+
+	if (stats_name) {
+		err = dnet_conv_stat_init(stats_name);
+		if (err) {
+			fprintf(stderr, "Failed to enable stats: %d.\n", err);
+			goto err_out_exit;
+		}
+	}
+
+	err = dnet_conv_log_init(log_level, DNET_CONV_PROGRESS_INTERVAL);
+	if (err) {
+		fprintf(stderr, "Failed to start logger: %d.\n", err);
+		goto err_out_exit;
+	}
 
 	printf("opening %s meta database\n", meta_name);
 	meta = kcdbnew();
@@ -229,52 +699,166 @@ int main(int argc, char *argv[])
 		goto err_out_exit;
 	}
 
-	printf("opening %s new meta database\n", newmeta_name);
+	ptrs.meta = meta;
+
+	if (history_name) {
+		printf("opening %s history database\n", history_name);
+		history = kcdbnew();
+		err = kcdbopen(history, history_name, KCOREADER | KCONOREPAIR);
+		if (!err) {
+			fprintf(stderr, "Failed to open history database '%s': %d.\n", history_name, -kcdbecode(history));
+			kcdbdel(history);
+			history = NULL;
+			goto err_out_dbopen;
+		}
+
+		ptrs.history = history;
+	}
+
+	if (bulk_load) {
+		printf("bulk loading %s new meta database\n", newmeta_name);
 
-	memset(&ecfg, 0, sizeof(ecfg));
-	ecfg.file = newmeta_name;
-	ecfg.sync = 30;
+		err = dnet_bulk_blob_init(&bulk, newmeta_name);
+		if (err)
+			goto err_out_dbopen;
 
-	log.log = dnet_common_log;
-	log.log_private = NULL;
-	log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
-	ecfg.log = &log;
+		ptrs.bulk = &bulk;
+	} else {
+		if (use_index) {
+			printf("loading %s new meta index\n", newmeta_name);
+
+			err = dnet_meta_index_build(&index, newmeta_name);
+			if (err)
+				goto err_out_dbopen;
+
+			ptrs.index = &index;
+			printf("loaded %llu records\n", (unsigned long long)index.num);
+		}
 
-	newmeta = eblob_init(&ecfg);
-	if (!newmeta) {
-		fprintf(stderr, "Failed to open meta database '%s'.\n", newmeta_name);
-		goto err_out_dbopen;
+		memset(&ecfg, 0, sizeof(ecfg));
+		ecfg.file = newmeta_name;
+		ecfg.sync = 30;
+
+		if (!dry_run) {
+			printf("opening %s new meta database\n", newmeta_name);
+
+			log.log = dnet_common_log;
+			log.log_private = NULL;
+			log.log_mask = EBLOB_LOG_ERROR | EBLOB_LOG_INFO | EBLOB_LOG_NOTICE;
+			ecfg.log = &log;
+
+			newmeta = eblob_init(&ecfg);
+			if (!newmeta) {
+				fprintf(stderr, "Failed to open meta database '%s'.\n", newmeta_name);
+				goto err_out_dbopen;
+			}
+
+			ptrs.newmeta = newmeta;
+		}
 	}
 
-	ptrs.newmeta = newmeta;
+	err = dnet_meta_writer_start(&ptrs.writer, newmeta, ptrs.bulk, DNET_META_WRITER_QUEUE_SIZE);
+	if (err) {
+		fprintf(stderr, "Failed to start meta writer: %d.\n", err);
+		goto err_out_dbopen2;
+	}
 
 	t = time(NULL);
 	tm = localtime(&t);
 	strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
 	total = (unsigned long long)kcdbcount(meta);
 	fprintf(stderr, "%s: Total %llu records in old meta DB\n", tstr, total);
+	if (history) {
+		total += (unsigned long long)kcdbcount(history);
+		fprintf(stderr, "%s: Total %llu records in old meta and history DBs\n", tstr, total);
+	}
+	if (shard.num > 1)
+		total /= shard.num;
 
-	err = kcdbiterate(meta, mparser_visit, &ptrs, 0);
-	if (!err) {
-		fprintf(stderr, "Failed to iterate meta database '%s': %d.\n", meta_name, -kcdbecode(meta));
+	/* bulk loaded blob is only complete once it is closed */
+	if (!bulk_load && !dry_run) {
+		err = dnet_checkpoint_init(&ckpt, ckpt_path, &ptrs.writer, ecfg.sync + 1);
+		if (err)
+			goto err_out_stop_writer;
+
+		c = &ckpt;
+	}
+
+	dnet_conv_progress_start(mparser_processed, &ptrs, total);
+
+	if (thread_num > 1) {
+		err = mparser_start_workers(&ptrs, thread_num);
+		if (err)
+			goto err_out_stop_workers;
+	}
+
+	if (resume_pass == 0) {
+		err = mparser_iterate(meta, ptrs.worker_num ? mparser_dispatch : mparser_visit, &ptrs, c,
+				0, resume_key, resume_size);
+		if (err) {
+			fprintf(stderr, "Failed to iterate meta database '%s': %d.\n", meta_name, err);
+			goto err_out_stop_workers;
+		}
+
+		resume_key = NULL;
 	}
 
+	if (history) {
+		err = mparser_iterate(history, mparser_history_visit, &ptrs, c, 1, resume_key, resume_size);
+		if (err) {
+			fprintf(stderr, "Failed to iterate history database '%s': %d.\n", history_name, err);
+		}
+	}
+
+err_out_stop_workers:
+	mparser_stop_workers(&ptrs);
+	dnet_meta_writer_stop(&ptrs.writer);
+	dnet_conv_progress_stop();
+	dnet_meta_arena_destroy(&ptrs.arena);
+	if (c)
+		dnet_checkpoint_cleanup(c, !err);
+
 	t = time(NULL);
 	tm = localtime(&t);
 	strftime(tstr, sizeof(tstr), "%F %R:%S %Z", tm);
-	total = (unsigned long long)kcdbcount(meta);
-	fprintf(stderr, "%s: Totally processed %llu records from history DB\n", tstr, counter);
+	fprintf(stderr, "%s: Totally processed %llu records from meta DB, written: %llu, write errors: %llu\n",
+			tstr, counter, (unsigned long long)ptrs.writer.written,
+			(unsigned long long)ptrs.writer.errors);
+
+	/* every record written by this tool is a new one; total is this shard's share */
+	if (dry_run)
+		dnet_meta_writer_report(&ptrs.writer, counter, ptrs.writer.queued, total);
 
+	goto err_out_dbopen2;
+
+err_out_stop_writer:
+	dnet_meta_writer_stop(&ptrs.writer);
 err_out_dbopen2:
-	eblob_cleanup(newmeta);
+	if (ptrs.bulk)
+		bulk_err = dnet_bulk_blob_cleanup(ptrs.bulk);
+	else if (newmeta)
+		eblob_cleanup(newmeta);
 
 err_out_dbopen:
+	if (ptrs.index)
+		dnet_meta_index_destroy(ptrs.index);
+
+	if (history) {
+		if (!kcdbclose(history))
+			fprintf(stderr, "Failed to close history database '%s': %d.\n", history_name, -kcdbecode(history));
+		kcdbdel(history);
+	}
+
 	err = kcdbclose(meta);
 	if (!err)
 		fprintf(stderr, "Failed to close meta database '%s': %d.\n", meta_name, -kcdbecode(meta));
 	err = !err;
 	kcdbdel(meta);
 
+	if (bulk_err)
+		err = bulk_err;
+
 err_out_exit:
+	dnet_conv_log_exit();
 	return err;
 }